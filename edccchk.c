@@ -18,20 +18,142 @@
 //
 ////////////////////////////////////////////////////////////////////////////////
 
+// CPU affinity for NUMA placement is a GNU extension
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE 1
+#endif
+
 #include "common.h"
+#include <math.h>
 #include <stdio.h>
+
+// Worker threads are only available where POSIX threads are
+#if defined(_POSIX_VERSION) && !defined(NO_THREADS)
+#define HAVE_PTHREADS 1
+#include <pthread.h>
+#endif
+
+// State of a single image check is per thread, so that a batch can check several images at once
+#if defined(HAVE_PTHREADS) && defined(__GNUC__)
+#define THREAD_LOCAL __thread
+#else
+#define THREAD_LOCAL
+#endif
+
+// Block device queue attributes and the NUMA topology are read from sysfs
+#if defined(__linux__)
+#include <sys/sysmacros.h>
+#endif
+
+#if defined(HAVE_PTHREADS) && defined(__linux__)
+#define HAVE_NUMA 1
+#include <sched.h>
+#endif
+
+// Background mode lowers the CPU and, on Linux, the I/O scheduling priority
+#if defined(_POSIX_VERSION)
+#include <sys/resource.h>
+#endif
+
+// posix_fadvise() page cache hints
+#if defined(_POSIX_VERSION)
+#include <fcntl.h>
+#endif
+
+// The check server listens on a Unix socket
+#if defined(HAVE_PTHREADS) && !defined(_WIN32)
+#define HAVE_SERVER 1
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+// Watched folders are followed with inotify
+#if defined(HAVE_SERVER) && defined(__linux__)
+#define HAVE_WATCH 1
+#include <dirent.h>
+#include <sys/inotify.h>
+#endif
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+// In-place repair writes sectors back with pwrite() and flushes with fsync()
+#if defined(_POSIX_VERSION)
+#define HAVE_REPAIR 1
+#endif
+
+// A reader of --events-fd that goes away must not kill the check with SIGPIPE
+#if defined(_POSIX_VERSION)
+#include <signal.h>
+#endif
+
+// Images piped to standard input are read in binary mode
+#if defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+// x86 SIMD kernels are selected at runtime, so build them on any GCC-compatible x86 compiler
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+// NEON kernels are built with GCC vector extensions and enabled from HWCAP at runtime
+#if defined(__GNUC__) && defined(__linux__) && (defined(__aarch64__) || (defined(__arm__) && defined(__ARM_PCS_VFP)))
+#define HAVE_ARM_SIMD 1
+#include <sys/auxv.h>
+#if defined(__arm__)
+#define NEON_TARGET __attribute__((target("fpu=neon")))
+#else
+#define NEON_TARGET
+#endif
+#ifndef HWCAP_ARM_NEON
+#define HWCAP_ARM_NEON (1 << 12)
+#endif
+#ifndef HWCAP_ASIMD
+#define HWCAP_ASIMD (1 << 1)
+#endif
+#endif
 #define CSV_FILENAME "edccchk_out.csv"
+#define CSV_HEADER "Filename,Non-data sectors,Mode 0 sectors,Mode 0 sectors with errors,Mode 1 sectors,Mode 1 sectors with errors,Mode 2 form 1 sectors,Mode 2 form 1 sectors with errors,Mode 2 form 1 sectors with warnings,Mode 2 form 2 sectors,Mode 2 form 2 sectors with errors,Mode 2 form 2 sectors with warnings,Filled sectors,Total sectors,Total errors,Total warnings,Mode 1 - ECC P Errors,Mode 1 - ECC Q Errors,Mode 1 - EDC Errors,Mode 2 Form 1 - ECC P Errors,Mode 2 Form 1 - ECC Q Errors,Mode 2 Form 1 - EDC Errors,Mode 2 Form 2 - EDC Errors,Total ECC P Errors,Total ECC Q Errors,Total EDC Errors,Sampled,Image sectors,Estimated error rate,Error rate CI low,Error rate CI high\n"
 static FILE *csv_file = NULL;
 
 static void open_csv_file() {
-    csv_file = fopen(CSV_FILENAME, "a"); // Open file in "append" mode
+    char line[sizeof(CSV_HEADER) + 1];
+    csv_file = fopen(CSV_FILENAME, "a+"); // Open file in "append" mode, readable for the header check
+    if (!csv_file) {
+        perror("Error opening CSV file");
+        exit(EXIT_FAILURE);
+    }
+    // Write CSV header only if file is newly created
+    fseek(csv_file, 0, SEEK_END);
+    if (ftell(csv_file) == 0) {
+        fputs(CSV_HEADER, csv_file);
+        return;
+    }
+    // Rows are only added under the header of the same columns
+    rewind(csv_file);
+    if (!fgets(line, sizeof(line), csv_file) || strcmp(line, CSV_HEADER) != 0) {
+        fprintf(stderr, "Error: %s has other columns than this version writes; move it aside to start a new one\n", CSV_FILENAME);
+        exit(EXIT_FAILURE);
+    }
+    fseek(csv_file, 0, SEEK_END);
+}
+
+#define DVD_CSV_FILENAME "edccchk_dvd_out.csv"
+
+static void open_dvd_csv_file() {
+    csv_file = fopen(DVD_CSV_FILENAME, "a"); // Open file in "append" mode
     if (!csv_file) {
         perror("Error opening CSV file");
         exit(EXIT_FAILURE);
     }
     // Write CSV header only if file is newly created
     if (ftell(csv_file) == 0) {
-        fprintf(csv_file, "Filename,Non-data sectors,Mode 0 sectors,Mode 0 sectors with errors,Mode 1 sectors,Mode 1 sectors with errors,Mode 2 form 1 sectors,Mode 2 form 1 sectors with errors,Mode 2 form 1 sectors with warnings,Mode 2 form 2 sectors,Mode 2 form 2 sectors with errors,Mode 2 form 2 sectors with warnings,Filled sectors,Total sectors,Total errors,Total warnings,Mode 1 - ECC P Errors,Mode 1 - ECC Q Errors,Mode 1 - EDC Errors,Mode 2 Form 1 - ECC P Errors,Mode 2 Form 1 - ECC Q Errors,Mode 2 Form 1 - EDC Errors,Mode 2 Form 2 - EDC Errors,Total ECC P Errors,Total ECC Q Errors,Total EDC Errors\n");
+        fprintf(csv_file, "Filename,ECC blocks,ECC blocks with errors,PI rows with errors,PO columns with errors,Trailing bytes\n");
     }
 }
 
@@ -52,8 +174,10 @@ static void write_csv_row(const char *filename,
                           uint32_t mode1_ecc_p_err, uint32_t mode1_ecc_q_err, uint32_t mode1_edc_err,
                           uint32_t mode2f1_ecc_p_err, uint32_t mode2f1_ecc_q_err, uint32_t mode2f1_edc_err,
                           uint32_t mode2f2_edc_err,
-                          uint32_t total_ecc_p_err, uint32_t total_ecc_q_err, uint32_t total_edc_err) {
-    fprintf(csv_file, "%s,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u\n",
+                          uint32_t total_ecc_p_err, uint32_t total_ecc_q_err, uint32_t total_edc_err,
+                          int8_t sampled, uint32_t imagesectors,
+                          double error_rate, double error_rate_low, double error_rate_high) {
+    fprintf(csv_file, "%s,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%d,%u,%.6f,%.6f,%.6f\n",
             filename,
             nondatasectors, mode0sectors, mode0errors,
             mode1sectors, mode1errors,
@@ -64,7 +188,18 @@ static void write_csv_row(const char *filename,
             mode1_ecc_p_err, mode1_ecc_q_err, mode1_edc_err,
             mode2f1_ecc_p_err, mode2f1_ecc_q_err, mode2f1_edc_err,
             mode2f2_edc_err,
-            total_ecc_p_err, total_ecc_q_err, total_edc_err);
+            total_ecc_p_err, total_ecc_q_err, total_edc_err,
+            sampled, imagesectors,
+            error_rate, error_rate_low, error_rate_high);
+}
+
+static void write_dvd_csv_row(const char *filename,
+                              uint32_t dvdblocks, uint32_t dvdblockerrors,
+                              uint32_t dvd_pi_err, uint32_t dvd_po_err, uint32_t trailingbytes) {
+    fprintf(csv_file, "%s,%u,%u,%u,%u,%u\n",
+            filename,
+            dvdblocks, dvdblockerrors,
+            dvd_pi_err, dvd_po_err, trailingbytes);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -132,36 +267,137 @@ static uint32_t get32lsb(const uint8_t *src)
            (((uint32_t)(src[3])) << 24);
 }
 
-static uint32_t nondatasectors;
-static uint32_t mode0sectors;
-static uint32_t mode0errors;
-static uint32_t mode1sectors;
-static uint32_t mode1errors;
-static uint32_t mode2f1sectors;
-static uint32_t mode2f1errors;
-static uint32_t mode2f1warnings;
-static uint32_t mode2f2sectors;
-static uint32_t mode2f2errors;
-static uint32_t mode2f2warnings;
-static uint32_t totalsectors;
-static uint32_t totalerrors;
-static uint32_t totalwarnings;
-static uint32_t filledsectors;
+static THREAD_LOCAL uint32_t nondatasectors;
+static THREAD_LOCAL uint32_t mode0sectors;
+static THREAD_LOCAL uint32_t mode0errors;
+static THREAD_LOCAL uint32_t mode1sectors;
+static THREAD_LOCAL uint32_t mode1errors;
+static THREAD_LOCAL uint32_t mode2f1sectors;
+static THREAD_LOCAL uint32_t mode2f1errors;
+static THREAD_LOCAL uint32_t mode2f1warnings;
+static THREAD_LOCAL uint32_t mode2f2sectors;
+static THREAD_LOCAL uint32_t mode2f2errors;
+static THREAD_LOCAL uint32_t mode2f2warnings;
+static THREAD_LOCAL uint32_t totalsectors;
+static THREAD_LOCAL uint32_t totalerrors;
+static THREAD_LOCAL uint32_t totalwarnings;
+static THREAD_LOCAL uint32_t filledsectors;
 
 // ehw addition
-static uint32_t	total_ecc_p_err;
-static uint32_t	total_ecc_q_err;
-static uint32_t	total_edc_err;
+static THREAD_LOCAL uint32_t	total_ecc_p_err;
+static THREAD_LOCAL uint32_t	total_ecc_q_err;
+static THREAD_LOCAL uint32_t	total_edc_err;
 	
-static uint32_t	mode1_ecc_p_err;
-static uint32_t	mode1_ecc_q_err;
-static uint32_t	mode1_edc_err;
+static THREAD_LOCAL uint32_t	mode1_ecc_p_err;
+static THREAD_LOCAL uint32_t	mode1_ecc_q_err;
+static THREAD_LOCAL uint32_t	mode1_edc_err;
 	
-static uint32_t	mode2f1_ecc_p_err;
-static uint32_t	mode2f1_ecc_q_err;
-static uint32_t	mode2f1_edc_err;
+static THREAD_LOCAL uint32_t	mode2f1_ecc_p_err;
+static THREAD_LOCAL uint32_t	mode2f1_ecc_q_err;
+static THREAD_LOCAL uint32_t	mode2f1_edc_err;
 	
-static uint32_t	mode2f2_edc_err;
+static THREAD_LOCAL uint32_t	mode2f2_edc_err;
+
+//
+// Image this thread checks in a batch run, NULL when checking a single image
+//
+static THREAD_LOCAL const char *job_name = NULL;
+
+//
+// Set by a batch run that wants the hash of the whole image; the check
+// sets job_hash_valid when it has hashed all of it
+//
+static THREAD_LOCAL int8_t   job_hash_wanted = 0;
+static THREAD_LOCAL int8_t   job_hash_valid  = 0;
+static THREAD_LOCAL uint64_t job_hash        = 0;
+
+//
+// Set by the server: the check stops when *job_cancel becomes nonzero, and
+// sector events go to job_event instead of stderr
+//
+typedef void (*job_event_fn)(void *ctx, const uint8_t *sector, const char *text);
+
+static THREAD_LOCAL volatile int8_t *job_cancel    = NULL;
+static THREAD_LOCAL job_event_fn     job_event     = NULL;
+static THREAD_LOCAL void            *job_event_ctx = NULL;
+
+static uint32_t dvdblocks;
+static uint32_t dvdblockerrors;
+static uint32_t dvd_pi_err;
+static uint32_t dvd_po_err;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Options
+//
+static int8_t      opt_dvd     = 0;
+static size_t      opt_threads = 0;
+static const char *opt_kernel  = "auto";
+static int8_t      opt_list    = 0;
+
+static double   opt_sample_percent = 0;
+static uint32_t opt_sample_sectors = 0;
+static uint64_t opt_seed           = 0;
+static int8_t   opt_seed_set       = 0;
+
+static uint32_t    opt_start_lba   = 0;
+static uint32_t    opt_end_lba     = 0;
+static uint32_t    opt_shard       = 0;
+static uint32_t    opt_shard_count = 0;
+static const char *opt_partial     = NULL;
+
+static size_t opt_device_readers = 1;
+static int8_t opt_numa           = 1;
+static const char *opt_serve    = NULL;
+static const char *opt_watch    = NULL;
+
+static double opt_max_read_rate = 0;
+static int8_t opt_background    = 0;
+
+static const char *opt_cache          = NULL;
+static double      opt_revalidate_age = 0;
+static int8_t      opt_index          = 0;
+static int8_t      opt_dedupe         = 0;
+
+static off_t opt_readahead = 8 << 20;
+
+static int opt_events_fd = -1;
+
+static const char *opt_ddrescue_map = NULL;
+static const char *opt_skip_map     = NULL;
+
+static int8_t      opt_compare   = 0;
+static const char *opt_merge_out = NULL;
+
+static const char *opt_ecm_out = NULL;
+
+static int8_t opt_repair = 0;
+static int8_t opt_undo   = 0;
+
+static const char *opt_extract_iso  = NULL;
+static const char *opt_extract_2336 = NULL;
+static const char *opt_bad_marker   = NULL;
+
+//
+// Matches "--name=value" or "--name value", advancing *i past a separate value
+//
+static const char *option_value(int argc, char **argv, int *i, const char *name)
+{
+    size_t len = strlen(name);
+    if(strncmp(argv[*i], name, len) != 0) { return NULL; }
+    if(argv[*i][len] == '=') { return argv[*i] + len + 1; }
+    if(argv[*i][len] == 0 && *i + 1 < argc) { return argv[++(*i)]; }
+    return NULL;
+}
+
+static size_t online_cpus(void)
+{
+#if defined(_SC_NPROCESSORS_ONLN)
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if(n > 0) { return (size_t)n; }
+#endif
+    return 1;
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -171,6 +407,25 @@ static uint8_t  ecc_f_lut[256];
 static uint8_t  ecc_b_lut[256];
 static uint32_t edc_lut[256];
 
+//
+// GF(2^8) exponent and logarithm tables over the same 0x11D polynomial, and
+// multiply-by-alpha^j tables for the DVD syndromes
+//
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+static uint8_t dvd_mul_lut[16][256];
+
+//
+// Slicing-by-8 tables: edc_slice_lut[k] advances the EDC over a byte followed
+// by k zero bytes
+//
+static uint32_t edc_slice_lut[8][256];
+
+static void edc_kernel_init(void);
+static void ecc_kernel_init(void);
+static void dvd_init(void);
+static void known_init(void);
+
 static void eccedc_init(void)
 {
     DPRINTF("Entering eccedc_init().\n");
@@ -184,33 +439,166 @@ static void eccedc_init(void)
         for(j = 0; j < 8; j++) { edc = (edc >> 1) ^ (edc & 1 ? 0xD8018001 : 0); }
         edc_lut[i] = edc;
     }
+
+    uint8_t x = 1;
+    for(i = 0; i < 255; i++)
+    {
+        gf_exp[i] = gf_exp[i + 255] = x;
+        gf_log[x]                   = i;
+        x                           = ecc_f_lut[x];
+    }
+    gf_exp[510] = gf_exp[0];
+    gf_exp[511] = gf_exp[1];
+
+    for(i = 0; i < 256; i++)
+    {
+        size_t k;
+        edc_slice_lut[0][i] = edc_lut[i];
+        for(k = 1; k < 8; k++)
+        {
+            edc_slice_lut[k][i] = (edc_slice_lut[k - 1][i] >> 8) ^ edc_lut[edc_slice_lut[k - 1][i] & 0xFF];
+        }
+    }
+
+    edc_kernel_init();
+    ecc_kernel_init();
+    dvd_init();
+    known_init();
+}
+
+static uint8_t gf_mul(uint8_t a, uint8_t b)
+{
+    if(!a || !b) { return 0; }
+    return gf_exp[gf_log[a] + gf_log[b]];
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Compute EDC for a block
 //
-static uint32_t edc_compute(uint32_t edc, const uint8_t *src, size_t size)
+static uint32_t edc_compute_bytewise(uint32_t edc, const uint8_t *src, size_t size)
 {
-    DPRINTF("Entering edc_compute(%d, *%d, %d).\n");
     for(; size; size--) { edc = (edc >> 8) ^ edc_lut[(edc ^ (*src++)) & 0xFF]; }
     return edc;
 }
 
+//
+// Same, eight bytes per step
+//
+static uint32_t edc_compute_slice8(uint32_t edc, const uint8_t *src, size_t size)
+{
+    for(; size >= 8; size -= 8, src += 8)
+    {
+        uint32_t lo = edc ^ get32lsb(src);
+        uint32_t hi = get32lsb(src + 4);
+        edc = edc_slice_lut[7][lo & 0xFF] ^ edc_slice_lut[6][(lo >> 8) & 0xFF] ^ edc_slice_lut[5][(lo >> 16) & 0xFF] ^
+              edc_slice_lut[4][lo >> 24] ^ edc_slice_lut[3][hi & 0xFF] ^ edc_slice_lut[2][(hi >> 8) & 0xFF] ^
+              edc_slice_lut[1][(hi >> 16) & 0xFF] ^ edc_slice_lut[0][hi >> 24];
+    }
+    return edc_compute_bytewise(edc, src, size);
+}
+
+#ifdef HAVE_X86_SIMD
+//
+// Same, folding 64 bytes per step with PCLMULQDQ.  A 16-byte lane holds the
+// coefficient of x^127 in bit 0, so folding it d bits forward multiplies its
+// low half by x^(d+63) and its high half by x^(d-1) mod P; the extra x comes
+// from the bit the carry-less product leaves free at the top.  What remains
+// after folding is one lane, whose EDC is the same as that of all the lanes.
+//
+static uint64_t edc_fold_64[2];
+static uint64_t edc_fold_16[2];
+
+//
+// x^k mod P, placed for the fold
+//
+static uint64_t edc_xpow(size_t k)
+{
+    uint32_t edc = 0x80000000;
+    for(; k; k--) { edc = (edc >> 1) ^ (edc & 1 ? 0xD8018001 : 0); }
+    return ((uint64_t)edc) << 32;
+}
+
+__attribute__((target("pclmul,sse2"))) static inline __m128i edc_fold(__m128i x, __m128i k, const uint8_t *src)
+{
+    return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11)),
+                         _mm_loadu_si128((const __m128i *)src));
+}
+
+__attribute__((target("pclmul,sse2"))) static uint32_t
+    edc_compute_pclmul(uint32_t edc, const uint8_t *src, size_t size)
+{
+    uint8_t lane[16];
+    __m128i k;
+    __m128i x0;
+    __m128i x1;
+    __m128i x2;
+    __m128i x3;
+
+    if(size < 128) { return edc_compute_slice8(edc, src, size); }
+
+    x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)src), _mm_cvtsi32_si128((int)edc));
+    x1 = _mm_loadu_si128((const __m128i *)(src + 16));
+    x2 = _mm_loadu_si128((const __m128i *)(src + 32));
+    x3 = _mm_loadu_si128((const __m128i *)(src + 48));
+    src += 64;
+    size -= 64;
+
+    k = _mm_loadu_si128((const __m128i *)edc_fold_64);
+    for(; size >= 64; size -= 64, src += 64)
+    {
+        x0 = edc_fold(x0, k, src);
+        x1 = edc_fold(x1, k, src + 16);
+        x2 = edc_fold(x2, k, src + 32);
+        x3 = edc_fold(x3, k, src + 48);
+    }
+
+    k = _mm_loadu_si128((const __m128i *)edc_fold_16);
+    _mm_storeu_si128((__m128i *)lane, x1);
+    x0 = edc_fold(x0, k, lane);
+    _mm_storeu_si128((__m128i *)lane, x2);
+    x0 = edc_fold(x0, k, lane);
+    _mm_storeu_si128((__m128i *)lane, x3);
+    x0 = edc_fold(x0, k, lane);
+    for(; size >= 16; size -= 16, src += 16) { x0 = edc_fold(x0, k, src); }
+
+    _mm_storeu_si128((__m128i *)lane, x0);
+    return edc_compute_slice8(edc_compute_slice8(0, lane, 16), src, size);
+}
+#endif
+
+static void edc_kernel_init(void)
+{
+#ifdef HAVE_X86_SIMD
+    edc_fold_64[0] = edc_xpow(512 + 63);
+    edc_fold_64[1] = edc_xpow(512 - 1);
+    edc_fold_16[0] = edc_xpow(128 + 63);
+    edc_fold_16[1] = edc_xpow(128 - 1);
+#endif
+}
+
+typedef uint32_t (*edc_kernel_fn)(uint32_t edc, const uint8_t *src, size_t size);
+
+static edc_kernel_fn edc_kernel = edc_compute_slice8;
+
+static uint32_t edc_compute(uint32_t edc, const uint8_t *src, size_t size)
+{
+    DPRINTF("Entering edc_compute(%d, *%d, %d).\n");
+    return edc_kernel(edc, src, size);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Check ECC block (either P or Q)
-// Returns true if the ECC data is an exact match
+// Compute ECC block (either P or Q)
 //
-static int8_t ecc_checkpq(const uint8_t *address,
+static void ecc_computepq(const uint8_t *address,
                           const uint8_t *data,
                           size_t         major_count,
                           size_t         minor_count,
                           size_t         major_mult,
                           size_t         minor_inc,
-                          const uint8_t *ecc)
+                          uint8_t       *ecc)
 {
-    DPRINTF("Entering ecc_checkpq(*%d, *%d, %d, %d, %d, %d, *%d).\n");
     size_t size = major_count * minor_count;
     size_t major;
     for(major = 0; major < major_count; major++)
@@ -233,545 +621,6691 @@ static int8_t ecc_checkpq(const uint8_t *address,
             ecc_b ^= temp;
             ecc_a = ecc_f_lut[ecc_a];
         }
-        ecc_a = ecc_b_lut[ecc_f_lut[ecc_a] ^ ecc_b];
-
-        if(ecc[major] != (ecc_a) || ecc[major + major_count] != (ecc_a ^ ecc_b)) { return 0; }
+        ecc_a                    = ecc_b_lut[ecc_f_lut[ecc_a] ^ ecc_b];
+        ecc[major]               = ecc_a;
+        ecc[major + major_count] = ecc_a ^ ecc_b;
     }
-    return 1;
 }
 
 //
-// Check ECC P and Q codes for a sector
+// Check ECC block (either P or Q)
 // Returns true if the ECC data is an exact match
 //
-static int8_t ecc_checksector(const uint8_t *address, const uint8_t *data, const uint8_t *ecc)
+static int8_t ecc_checkpq(const uint8_t *address,
+                          const uint8_t *data,
+                          size_t         major_count,
+                          size_t         minor_count,
+                          size_t         major_mult,
+                          size_t         minor_inc,
+                          const uint8_t *ecc)
 {
-    DPRINTF("Entering ecc_checksector(*%d, *%d, *%d).\n");
-    return ecc_checkpq(address, data, 86, 24, 2, 86, ecc) &&       // P
-           ecc_checkpq(address, data, 52, 43, 86, 88, ecc + 0xAC); // Q
+    DPRINTF("Entering ecc_checkpq(*%d, *%d, %d, %d, %d, %d, *%d).\n");
+    uint8_t computed[0xAC];
+    ecc_computepq(address, data, major_count, minor_count, major_mult, minor_inc, computed);
+    return !memcmp(computed, ecc, major_count * 2);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
+//
+// ECC kernels
+//
+// A kernel computes the 0xAC bytes of P and 0x68 bytes of Q for a sector.  Q
+// is computed over the P bytes stored in the sector, like ecc_checkpq() does,
+// so P and Q failures stay independent.
+//
+#define ECC_BYTES 0x114
 
-static const uint8_t zeroaddress[4] = {0, 0, 0, 0};
-
-////////////////////////////////////////////////////////////////////////////////
-
-static off_t mycounter_analyze = (off_t)-1;
-static off_t mycounter_encode  = (off_t)-1;
-static off_t mycounter_decode  = (off_t)-1;
-static off_t mycounter_total   = 0;
+typedef void (*ecc_kernel_fn)(const uint8_t *address, const uint8_t *data, uint8_t *ecc);
 
-static void resetcounter(off_t total)
+static void ecc_compute_scalar(const uint8_t *address, const uint8_t *data, uint8_t *ecc)
 {
-    mycounter_analyze = (off_t)-1;
-    mycounter_encode  = (off_t)-1;
-    mycounter_decode  = (off_t)-1;
-    mycounter_total   = total;
+    ecc_computepq(address, data, 86, 24, 2, 86, ecc);         // P
+    ecc_computepq(address, data, 52, 43, 86, 88, ecc + 0xAC); // Q
 }
 
-static void encode_progress(void)
-{
-    off_t a = (mycounter_analyze + 64) / 128;
-    off_t t = (mycounter_total + 64) / 128;
-    if(!t) { t = 1; }
-    fprintf(stderr, "Analyze(%02u%%)\r", (unsigned)((((off_t)100) * a) / t));
-}
+//
+// Offset of the two bytes Q codeword pair n takes from minor step k
+//
+static uint16_t ecc_q_offsets[43][26];
 
-static void setcounter_analyze(off_t n)
+#ifdef HAVE_X86_SIMD
+//
+// GF2P8AFFINEQB matrices multiplying by alpha and dividing by (alpha + 1)
+// in the 0x11D basis.  Byte 7-i of a matrix selects the input bits XORed
+// into output bit i.
+//
+static uint64_t ecc_gfni_alpha;
+static uint64_t ecc_gfni_div;
+
+static uint64_t gfni_matrix(const uint8_t *lut)
 {
-    int8_t p          = ((n >> 20) != (mycounter_analyze >> 20));
-    mycounter_analyze = n;
-    if(p) { encode_progress(); }
+    uint64_t matrix = 0;
+    int      i;
+    int      k;
+    for(i = 0; i < 8; i++)
+    {
+        uint64_t row = 0;
+        for(k = 0; k < 8; k++) { row |= (uint64_t)((lut[1 << k] >> i) & 1) << k; }
+        matrix |= row << (8 * (7 - i));
+    }
+    return matrix;
 }
 
-////////////////////////////////////////////////////////////////////////////////
 //
-// Returns nonzero on error
+// AVX-512 kernel: P codewords are 86 adjacent lanes, Q codewords are gathered
+// into 52 lanes per step, and every multiply is a single affine transform
 //
-static int8_t ecmify(const char *infilename)
+__attribute__((target("avx512f,avx512bw,gfni"))) static void
+    ecc_compute_gfni(const uint8_t *address, const uint8_t *data, uint8_t *ecc)
 {
-    DPRINTF("Entering ecmify(\"%s\").\n", infilename);
-    int8_t returncode = 0;
-    int8_t filled     = 0;
-
-    FILE *in = NULL;
-
-    uint8_t *queue                 = NULL;
-    size_t   queue_start_ofs       = 0;
-    size_t   queue_bytes_available = 0;
-
-    uint32_t input_edc = 0;
+    uint8_t         buf[4 + 0x8B8];
+    uint8_t         lanes[64];
+    const __m512i   alpha = _mm512_set1_epi64(ecc_gfni_alpha);
+    const __m512i   div   = _mm512_set1_epi64(ecc_gfni_div);
+    const __mmask64 p_hi  = (((__mmask64)1) << 22) - 1;
+    const __mmask64 q_all = (((__mmask64)1) << 52) - 1;
+    __m512i         a0    = _mm512_setzero_si512();
+    __m512i         a1    = _mm512_setzero_si512();
+    __m512i         b0    = _mm512_setzero_si512();
+    __m512i         b1    = _mm512_setzero_si512();
+    size_t          k;
+    size_t          n;
 
-    off_t input_file_length;
-    off_t input_bytes_checked = 0;
-    off_t input_bytes_queued  = 0;
+    memcpy(buf, address, 4);
+    memcpy(buf + 4, data, 0x8B8);
 
-    size_t queue_size = ((size_t)(-1)) - 4095;
-    if((unsigned long)queue_size > 0x40000lu) { queue_size = (size_t)0x40000lu; }
+    for(k = 0; k < 24; k++)
+    {
+        __m512i x0 = _mm512_loadu_si512(buf + 86 * k);
+        __m512i x1 = _mm512_maskz_loadu_epi8(p_hi, buf + 86 * k + 64);
+        a0         = _mm512_gf2p8affine_epi64_epi8(_mm512_xor_si512(a0, x0), alpha, 0);
+        a1         = _mm512_gf2p8affine_epi64_epi8(_mm512_xor_si512(a1, x1), alpha, 0);
+        b0         = _mm512_xor_si512(b0, x0);
+        b1         = _mm512_xor_si512(b1, x1);
+    }
+    a0 = _mm512_gf2p8affine_epi64_epi8(_mm512_xor_si512(_mm512_gf2p8affine_epi64_epi8(a0, alpha, 0), b0), div, 0);
+    a1 = _mm512_gf2p8affine_epi64_epi8(_mm512_xor_si512(_mm512_gf2p8affine_epi64_epi8(a1, alpha, 0), b1), div, 0);
+    _mm512_storeu_si512(ecc, a0);
+    _mm512_mask_storeu_epi8(ecc + 64, p_hi, a1);
+    _mm512_storeu_si512(ecc + 86, _mm512_xor_si512(a0, b0));
+    _mm512_mask_storeu_epi8(ecc + 86 + 64, p_hi, _mm512_xor_si512(a1, b1));
 
-    //
-    // Allocate space for queue
-    //
-    DPRINTF("ecmify(): Allocation memory for queue.\n");
-    queue = malloc(queue_size);
-    if(!queue)
+    a0 = _mm512_setzero_si512();
+    b0 = _mm512_setzero_si512();
+    memset(lanes, 0, sizeof(lanes));
+    for(k = 0; k < 43; k++)
     {
-        printf("Out of memory\n");
-        goto error;
+        __m512i x;
+        for(n = 0; n < 26; n++) { memcpy(lanes + 2 * n, buf + ecc_q_offsets[k][n], 2); }
+        x  = _mm512_loadu_si512(lanes);
+        a0 = _mm512_gf2p8affine_epi64_epi8(_mm512_xor_si512(a0, x), alpha, 0);
+        b0 = _mm512_xor_si512(b0, x);
     }
+    a0 = _mm512_gf2p8affine_epi64_epi8(_mm512_xor_si512(_mm512_gf2p8affine_epi64_epi8(a0, alpha, 0), b0), div, 0);
+    _mm512_mask_storeu_epi8(ecc + 0xAC, q_all, a0);
+    _mm512_mask_storeu_epi8(ecc + 0xAC + 52, q_all, _mm512_xor_si512(a0, b0));
+}
+#endif
 
-    //
-    // Open both files
-    //
-    DPRINTF("ecmify(): Opening file \"%s\".\n", infilename);
-    in = fopen(infilename, "rb");
-    if(!in) { goto error_in; }
+#if defined(HAVE_X86_SIMD) || defined(HAVE_ARM_SIMD)
+//
+// Vector-extension kernels: the same lane layout as the GFNI kernel with
+// GCC vector types, built once per vector width.  Multiplying by alpha is a
+// shift and a masked XOR; dividing by (alpha + 1) goes through nibble tables
+// (PSHUFB on x86, VTBL/TBL on ARM).
+//
+static uint8_t ecc_vec_div_lo[32];
+static uint8_t ecc_vec_div_hi[32];
 
-    printf("Checking %s...\n", infilename);
+#define ECC_VECTOR_KERNEL(NAME, WIDTH, TARGET)                                                                         \
+    typedef uint8_t NAME##_u8 __attribute__((vector_size(WIDTH)));                                                     \
+    typedef int8_t  NAME##_s8 __attribute__((vector_size(WIDTH)));                                                     \
+                                                                                                                       \
+    TARGET static inline NAME##_u8 NAME##_xtime(NAME##_u8 x)                                                           \
+    {                                                                                                                  \
+        return (x << 1) ^ ((NAME##_u8)((NAME##_s8)x >> 7) & 0x1D);                                                     \
+    }                                                                                                                  \
+                                                                                                                       \
+    TARGET static inline NAME##_u8 NAME##_div(NAME##_u8 x)                                                             \
+    {                                                                                                                  \
+        NAME##_u8 lo;                                                                                                  \
+        NAME##_u8 hi;                                                                                                  \
+        memcpy(&lo, ecc_vec_div_lo, WIDTH);                                                                            \
+        memcpy(&hi, ecc_vec_div_hi, WIDTH);                                                                            \
+        return __builtin_shuffle(lo, x & 0x0F) ^ __builtin_shuffle(hi, x >> 4);                                        \
+    }                                                                                                                  \
+                                                                                                                       \
+    TARGET static void ecc_compute_##NAME(const uint8_t *address, const uint8_t *data, uint8_t *ecc)                   \
+    {                                                                                                                  \
+        enum                                                                                                           \
+        {                                                                                                              \
+            P_VECTORS = (86 + WIDTH - 1) / WIDTH,                                                                      \
+            Q_VECTORS = (52 + WIDTH - 1) / WIDTH                                                                       \
+        };                                                                                                             \
+        uint8_t   buf[4 + 0x8B8];                                                                                      \
+        uint8_t   lanes[P_VECTORS * WIDTH];                                                                            \
+        NAME##_u8 a[P_VECTORS];                                                                                        \
+        NAME##_u8 b[P_VECTORS];                                                                                        \
+        NAME##_u8 x;                                                                                                   \
+        size_t    k;                                                                                                   \
+        size_t    n;                                                                                                   \
+        size_t    v;                                                                                                   \
+                                                                                                                       \
+        memcpy(buf, address, 4);                                                                                       \
+        memcpy(buf + 4, data, 0x8B8);                                                                                  \
+                                                                                                                       \
+        for(v = 0; v < P_VECTORS; v++) { a[v] = b[v] = (NAME##_u8){0}; }                                              \
+        for(k = 0; k < 24; k++)                                                                                        \
+        {                                                                                                              \
+            for(v = 0; v < P_VECTORS; v++)                                                                             \
+            {                                                                                                          \
+                memcpy(&x, buf + 86 * k + WIDTH * v, WIDTH);                                                           \
+                a[v] = NAME##_xtime(a[v] ^ x);                                                                         \
+                b[v] ^= x;                                                                                             \
+            }                                                                                                          \
+        }                                                                                                              \
+        for(v = 0; v < P_VECTORS; v++)                                                                                 \
+        {                                                                                                              \
+            a[v] = NAME##_div(NAME##_xtime(a[v]) ^ b[v]);                                                              \
+            memcpy(lanes + WIDTH * v, &a[v], WIDTH);                                                                   \
+        }                                                                                                              \
+        memcpy(ecc, lanes, 86);                                                                                        \
+        for(v = 0; v < P_VECTORS; v++)                                                                                 \
+        {                                                                                                              \
+            x = a[v] ^ b[v];                                                                                           \
+            memcpy(lanes + WIDTH * v, &x, WIDTH);                                                                      \
+        }                                                                                                              \
+        memcpy(ecc + 86, lanes, 86);                                                                                   \
+                                                                                                                       \
+        for(v = 0; v < Q_VECTORS; v++) { a[v] = b[v] = (NAME##_u8){0}; }                                              \
+        memset(lanes, 0, sizeof(lanes));                                                                               \
+        for(k = 0; k < 43; k++)                                                                                        \
+        {                                                                                                              \
+            for(n = 0; n < 26; n++) { memcpy(lanes + 2 * n, buf + ecc_q_offsets[k][n], 2); }                           \
+            for(v = 0; v < Q_VECTORS; v++)                                                                             \
+            {                                                                                                          \
+                memcpy(&x, lanes + WIDTH * v, WIDTH);                                                                  \
+                a[v] = NAME##_xtime(a[v] ^ x);                                                                         \
+                b[v] ^= x;                                                                                             \
+            }                                                                                                          \
+        }                                                                                                              \
+        for(v = 0; v < Q_VECTORS; v++)                                                                                 \
+        {                                                                                                              \
+            a[v] = NAME##_div(NAME##_xtime(a[v]) ^ b[v]);                                                              \
+            memcpy(lanes + WIDTH * v, &a[v], WIDTH);                                                                   \
+        }                                                                                                              \
+        memcpy(ecc + 0xAC, lanes, 52);                                                                                 \
+        for(v = 0; v < Q_VECTORS; v++)                                                                                 \
+        {                                                                                                              \
+            x = a[v] ^ b[v];                                                                                           \
+            memcpy(lanes + WIDTH * v, &x, WIDTH);                                                                      \
+        }                                                                                                              \
+        memcpy(ecc + 0xAC + 52, lanes, 52);                                                                            \
+    }
+#endif
 
-    //
-    // Get the length of the input file
-    //
-    DPRINTF("ecmify(): Seeking to end of file.\n");
-    if(fseeko(in, 0, SEEK_END) != 0) { goto error_in; }
-    input_file_length = ftello(in);
-    DPRINTF("ecmify(): Got file length %d.\n", input_file_length);
-    if(input_file_length < 0) { goto error_in; }
+#ifdef HAVE_X86_SIMD
+ECC_VECTOR_KERNEL(ssse3, 16, __attribute__((target("ssse3"))))
+ECC_VECTOR_KERNEL(avx2, 32, __attribute__((target("avx2"))))
+#endif
 
-    resetcounter(input_file_length);
+#ifdef HAVE_ARM_SIMD
+ECC_VECTOR_KERNEL(neon, 16, NEON_TARGET)
 
-    nondatasectors    = 0;
-    mode0sectors      = 0;
-    mode0errors       = 0;
-    mode1sectors      = 0;
-    mode1errors       = 0;
-    mode2f1sectors    = 0;
-    mode2f1errors     = 0;
-    mode2f1warnings   = 0;
-    mode2f2sectors    = 0;
-    mode2f2errors     = 0;
-    mode2f2warnings   = 0;
-    totalsectors      = 0;
-    totalerrors       = 0;
-    filledsectors     = 0;
-	
-	// ehw addition
-	total_ecc_p_err   = 0;
-	total_ecc_q_err   = 0;
-	total_edc_err     = 0;
-	
-	mode1_ecc_p_err   = 0;
-	mode1_ecc_q_err   = 0;
-	mode1_edc_err     = 0;
-	
-	mode2f1_ecc_p_err = 0;
-	mode2f1_ecc_q_err = 0;
-	mode2f1_edc_err   = 0;
-	
-	mode2f2_edc_err   = 0;
+static int8_t neon_supported(void)
+{
+#if defined(__aarch64__)
+    return (getauxval(AT_HWCAP) & HWCAP_ASIMD) != 0;
+#else
+    return (getauxval(AT_HWCAP) & HWCAP_ARM_NEON) != 0;
+#endif
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Bitsliced ECC
+//
+// Checks up to 64 sectors at once.  Byte position n of every sector is
+// transposed into eight 64-bit planes (plane j holds bit j of that byte for
+// every sector), so multiplying by alpha becomes a fixed set of XORs between
+// planes and each XOR works on all sectors in parallel.  It needs no table
+// lookups or vector shuffles at all.
+//
+#define BITSLICE_SECTORS   64
+#define BITSLICE_POSITIONS (4 + 0x920)
+
+//
+// Rows of the matrix dividing by (alpha + 1): bit k of row i is set when
+// input bit k contributes to output bit i
+//
+static uint8_t bitslice_div[8];
+
+//
+// Transpose an 8x8 bit matrix stored one row per byte
+//
+static uint64_t transpose8(uint64_t x)
+{
+    uint64_t t;
+    t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+    x = x ^ t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+    x = x ^ t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+    x = x ^ t ^ (t << 28);
+    return x;
+}
+
+static uint64_t get64lsb(const uint8_t *src) { return ((uint64_t)get32lsb(src)) | (((uint64_t)get32lsb(src + 4)) << 32); }
+
+//
+// Transpose an 8x8 byte matrix stored one row per word, so that byte k of
+// row i moves to byte i of row k
+//
+static void transpose8x8(uint64_t *w)
+{
+    uint64_t t;
+    size_t   i;
+    for(i = 0; i < 8; i += 2)
+    {
+        t = ((w[i] >> 8) ^ w[i + 1]) & 0x00FF00FF00FF00FFULL;
+        w[i + 1] ^= t;
+        w[i] ^= t << 8;
+    }
+    for(i = 0; i < 8; i += (i & 1) ? 3 : 1)
+    {
+        t = ((w[i] >> 16) ^ w[i + 2]) & 0x0000FFFF0000FFFFULL;
+        w[i + 2] ^= t;
+        w[i] ^= t << 16;
+    }
+    for(i = 0; i < 4; i++)
+    {
+        t = ((w[i] >> 32) ^ w[i + 4]) & 0x00000000FFFFFFFFULL;
+        w[i + 4] ^= t;
+        w[i] ^= t << 32;
+    }
+}
+
+//
+// Fill planes[position * 8 + bit]; byte g of every plane word holds sectors
+// 8g..8g+7, one per bit
+//
+static void bitslice_load(const uint8_t *const *address, const uint8_t *const *data, size_t count, uint64_t *planes)
+{
+    uint8_t *bytes = (uint8_t *)planes;
+    uint8_t  tile[8];
+    uint64_t w[8];
+    size_t   g;
+    size_t   i;
+    size_t   p;
+    size_t   k;
+    size_t   j;
+    for(g = 0; g < BITSLICE_SECTORS / 8; g++)
+    {
+        for(p = 0; p < BITSLICE_POSITIONS; p += 8)
+        {
+            size_t n = BITSLICE_POSITIONS - p < 8 ? BITSLICE_POSITIONS - p : 8;
+            for(i = 0; i < 8; i++)
+            {
+                size_t s = g * 8 + i;
+                if(s >= count) { w[i] = 0; }
+                else if(p == 0)
+                {
+                    memcpy(tile, address[s], 4);
+                    memcpy(tile + 4, data[s], 4);
+                    w[i] = get64lsb(tile);
+                }
+                else if(n < 8)
+                {
+                    memset(tile, 0, 8);
+                    memcpy(tile, data[s] + p - 4, n);
+                    w[i] = get64lsb(tile);
+                }
+                else
+                {
+                    w[i] = get64lsb(data[s] + p - 4);
+                }
+            }
+            transpose8x8(w);
+            for(k = 0; k < n; k++)
+            {
+                uint64_t x = transpose8(w[k]);
+                for(j = 0; j < 8; j++) { bytes[((p + k) * 8 + j) * 8 + g] = (uint8_t)(x >> (8 * j)); }
+            }
+        }
+    }
+}
+
+static void bitslice_xtime(uint64_t *a)
+{
+    uint64_t top = a[7];
+    a[7]         = a[6];
+    a[6]         = a[5];
+    a[5]         = a[4];
+    a[4]         = a[3] ^ top;
+    a[3]         = a[2] ^ top;
+    a[2]         = a[1] ^ top;
+    a[1]         = a[0];
+    a[0]         = top;
+}
+
+//
+// Compute one bitsliced ECC block (either P or Q) and return the planes of
+// every sector whose stored parity differs
+//
+static uint64_t bitslice_checkpq(const uint64_t *planes,
+                                 size_t          major_count,
+                                 size_t          minor_count,
+                                 size_t          major_mult,
+                                 size_t          minor_inc,
+                                 size_t          ecc_position)
+{
+    size_t   size = major_count * minor_count;
+    uint64_t diff = 0;
+    size_t   major;
+    for(major = 0; major < major_count; major++)
+    {
+        size_t   index = (major >> 1) * major_mult + (major & 1);
+        uint64_t ecc_a[8];
+        uint64_t ecc_b[8];
+        uint64_t quot[8];
+        size_t   minor;
+        size_t   j;
+        size_t   k;
+        memset(ecc_a, 0, sizeof(ecc_a));
+        memset(ecc_b, 0, sizeof(ecc_b));
+        for(minor = 0; minor < minor_count; minor++)
+        {
+            const uint64_t *x = planes + index * 8;
+            for(j = 0; j < 8; j++)
+            {
+                ecc_a[j] ^= x[j];
+                ecc_b[j] ^= x[j];
+            }
+            bitslice_xtime(ecc_a);
+            index += minor_inc;
+            if(index >= size) { index -= size; }
+        }
+        bitslice_xtime(ecc_a);
+        for(j = 0; j < 8; j++) { ecc_a[j] ^= ecc_b[j]; }
+        for(j = 0; j < 8; j++)
+        {
+            quot[j] = 0;
+            for(k = 0; k < 8; k++)
+            {
+                if(bitslice_div[j] & (1 << k)) { quot[j] ^= ecc_a[k]; }
+            }
+        }
+        for(j = 0; j < 8; j++)
+        {
+            diff |= quot[j] ^ planes[(ecc_position + major) * 8 + j];
+            diff |= quot[j] ^ ecc_b[j] ^ planes[(ecc_position + major + major_count) * 8 + j];
+        }
+    }
+    return diff;
+}
+
+//
+// Check ECC P and Q codes of count sectors (at most 64); ok[n] is set when
+// sector n is an exact match.  planes must hold BITSLICE_POSITIONS * 8 words.
+//
+static void ecc_checksectors_bitsliced(const uint8_t *const *address,
+                                       const uint8_t *const *data,
+                                       size_t                count,
+                                       uint64_t             *planes,
+                                       int8_t               *ok)
+{
+    uint64_t diff;
+    uint8_t  bytes[8];
+    size_t   n;
+    bitslice_load(address, data, count, planes);
+    diff = bitslice_checkpq(planes, 86, 24, 2, 86, 4 + 0x80C) |       // P
+           bitslice_checkpq(planes, 52, 43, 86, 88, 4 + 0x80C + 0xAC); // Q
+    memcpy(bytes, &diff, 8);
+    for(n = 0; n < count; n++) { ok[n] = !(bytes[n / 8] & (1 << (n % 8))); }
+}
+
+static ecc_kernel_fn ecc_kernel   = ecc_compute_scalar;
+static int8_t        ecc_bitslice = 0;
+
+static void ecc_kernel_init(void)
+{
+    size_t k;
+    size_t n;
+    for(k = 0; k < 43; k++)
+    {
+        for(n = 0; n < 26; n++) { ecc_q_offsets[k][n] = (86 * n + 88 * k) % 0x8BC; }
+    }
+    for(k = 0; k < 8; k++)
+    {
+        bitslice_div[k] = 0;
+        for(n = 0; n < 8; n++) { bitslice_div[k] |= ((ecc_b_lut[1 << n] >> k) & 1) << n; }
+    }
+#ifdef HAVE_X86_SIMD
+    ecc_gfni_alpha = gfni_matrix(ecc_f_lut);
+    ecc_gfni_div   = gfni_matrix(ecc_b_lut);
+#endif
+#if defined(HAVE_X86_SIMD) || defined(HAVE_ARM_SIMD)
+    for(k = 0; k < 32; k++)
+    {
+        ecc_vec_div_lo[k] = ecc_b_lut[k & 0x0F];
+        ecc_vec_div_hi[k] = ecc_b_lut[(k & 0x0F) << 4];
+    }
+#endif
+}
+
+//
+// Check ECC P and Q codes for a sector
+// Returns true if the ECC data is an exact match
+//
+static int8_t ecc_checksector(const uint8_t *address, const uint8_t *data, const uint8_t *ecc)
+{
+    DPRINTF("Entering ecc_checksector(*%d, *%d, *%d).\n");
+    uint8_t computed[ECC_BYTES];
+    ecc_kernel(address, data, computed);
+    return !memcmp(computed, ecc, ECC_BYTES);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static const uint8_t zeroaddress[4] = {0, 0, 0, 0};
+
+static const uint8_t sync_pattern[12] = {0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Sync and fill kernels
+//
+// Every sector is matched against the sync pattern and most have their user
+// data compared against a fill byte, so both get kernels of their own.
+//
+typedef int8_t (*sync_kernel_fn)(const uint8_t *sector);
+typedef int8_t (*fill_kernel_fn)(const uint8_t *src, size_t size, uint8_t value);
+
+static int8_t is_sync_scalar(const uint8_t *sector)
+{
+    return !memcmp(sector, sync_pattern, sizeof(sync_pattern));
+}
+
+static int8_t is_filled_swar(const uint8_t *src, size_t size, uint8_t value)
+{
+    uint64_t pattern = 0x0101010101010101ULL * value;
+    for(; size >= 32; size -= 32, src += 32)
+    {
+        if((get64lsb(src) ^ pattern) | (get64lsb(src + 8) ^ pattern) | (get64lsb(src + 16) ^ pattern) |
+           (get64lsb(src + 24) ^ pattern))
+        { return 0; }
+    }
+    for(; size; size--)
+    {
+        if(*src++ != value) { return 0; }
+    }
+    return 1;
+}
+
+#ifdef HAVE_X86_SIMD
+//
+// A sector is always longer than 16 bytes, so the pattern takes one load
+//
+__attribute__((target("sse2"))) static int8_t is_sync_sse2(const uint8_t *sector)
+{
+    __m128i v = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)sector),
+                               _mm_setr_epi8(0, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 0, 0, 0, 0));
+    return (_mm_movemask_epi8(v) & 0x0FFF) == 0x0FFF;
+}
+
+__attribute__((target("sse2"))) static int8_t is_filled_sse2(const uint8_t *src, size_t size, uint8_t value)
+{
+    const __m128i pattern = _mm_set1_epi8((char)value);
+    for(; size >= 64; size -= 64, src += 64)
+    {
+        __m128i v = _mm_or_si128(_mm_or_si128(_mm_xor_si128(_mm_loadu_si128((const __m128i *)src), pattern),
+                                              _mm_xor_si128(_mm_loadu_si128((const __m128i *)(src + 16)), pattern)),
+                                 _mm_or_si128(_mm_xor_si128(_mm_loadu_si128((const __m128i *)(src + 32)), pattern),
+                                              _mm_xor_si128(_mm_loadu_si128((const __m128i *)(src + 48)), pattern)));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xFFFF) { return 0; }
+    }
+    return is_filled_swar(src, size, value);
+}
+
+__attribute__((target("avx2"))) static int8_t is_filled_avx2(const uint8_t *src, size_t size, uint8_t value)
+{
+    const __m256i pattern = _mm256_set1_epi8((char)value);
+    for(; size >= 128; size -= 128, src += 128)
+    {
+        __m256i v = _mm256_or_si256(
+            _mm256_or_si256(_mm256_xor_si256(_mm256_loadu_si256((const __m256i *)src), pattern),
+                            _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(src + 32)), pattern)),
+            _mm256_or_si256(_mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(src + 64)), pattern),
+                            _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(src + 96)), pattern)));
+        if(!_mm256_testz_si256(v, v)) { return 0; }
+    }
+    return is_filled_swar(src, size, value);
+}
+#endif
+
+static sync_kernel_fn sync_kernel = is_sync_scalar;
+static fill_kernel_fn fill_kernel = is_filled_swar;
+
+//
+// Returns true if the sector starts with the sync pattern
+//
+static int8_t is_sync(const uint8_t *sector) { return sync_kernel(sector); }
+
+//
+// Returns true if all size bytes at src equal value
+//
+static int8_t is_filled(const uint8_t *src, size_t size, uint8_t value) { return fill_kernel(src, size, value); }
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// ECC results of the sectors ahead in the queue, computed a batch at a time
+// when the bitsliced kernel is in use
+//
+typedef struct
+{
+    uint64_t *planes;
+    uint32_t  first;
+    size_t    count;
+    int8_t    valid[BITSLICE_SECTORS];
+    int8_t    ok[BITSLICE_SECTORS];
+} ecc_batch;
+
+static void ecc_batch_fill(ecc_batch *batch, const uint8_t *queue, size_t available, uint32_t first)
+{
+    const uint8_t *address[BITSLICE_SECTORS];
+    const uint8_t *data[BITSLICE_SECTORS];
+    size_t         slot[BITSLICE_SECTORS];
+    int8_t         ok[BITSLICE_SECTORS];
+    size_t         n = 0;
+    size_t         i;
+
+    batch->first = first;
+    batch->count = available / 2352;
+    if(batch->count > BITSLICE_SECTORS) { batch->count = BITSLICE_SECTORS; }
+
+    for(i = 0; i < batch->count; i++)
+    {
+        const uint8_t *sector = queue + i * 2352;
+        batch->valid[i]       = 0;
+        if(!is_sync(sector)) { continue; }
+        if(sector[0x00F] == 0x01)
+        {
+            address[n] = sector + 0xC;
+            data[n]    = sector + 0x10;
+        }
+        else if(sector[0x00F] == 0x02 && (sector[0x012] & 0x20) == 0)
+        {
+            address[n] = zeroaddress;
+            data[n]    = sector + 0x10;
+        }
+        else
+        {
+            continue;
+        }
+        slot[n++] = i;
+    }
+
+    ecc_checksectors_bitsliced(address, data, n, batch->planes, ok);
+    for(i = 0; i < n; i++)
+    {
+        batch->valid[slot[i]] = 1;
+        batch->ok[slot[i]]    = ok[i];
+    }
+}
+
+//
+// Check ECC P and Q codes for sector number sectornumber, from the batch
+// when it has been computed there
+//
+static int8_t ecc_batch_check(const ecc_batch *batch,
+                              uint32_t         sectornumber,
+                              const uint8_t   *address,
+                              const uint8_t   *data,
+                              const uint8_t   *ecc)
+{
+    if(batch->planes && sectornumber - batch->first < batch->count && batch->valid[sectornumber - batch->first])
+    { return batch->ok[sectornumber - batch->first]; }
+    return ecc_checksector(address, data, ecc);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static THREAD_LOCAL off_t mycounter_analyze = (off_t)-1;
+static THREAD_LOCAL off_t mycounter_encode  = (off_t)-1;
+static THREAD_LOCAL off_t mycounter_decode  = (off_t)-1;
+static THREAD_LOCAL off_t mycounter_total   = 0;
+
+static void resetcounter(off_t total)
+{
+    mycounter_analyze = (off_t)-1;
+    mycounter_encode  = (off_t)-1;
+    mycounter_decode  = (off_t)-1;
+    mycounter_total   = total;
+}
+
+static void encode_progress(void)
+{
+    off_t a = (mycounter_analyze + 64) / 128;
+    off_t t = (mycounter_total + 64) / 128;
+    // The length of a stream isn't known
+    if(!mycounter_total)
+    {
+        fprintf(stderr, "Analyze(%u MB)\r", (unsigned)(mycounter_analyze >> 20));
+        return;
+    }
+    if(!t) { t = 1; }
+    fprintf(stderr, "Analyze(%02u%%)\r", (unsigned)((((off_t)100) * a) / t));
+}
+
+static void setcounter_analyze(off_t n)
+{
+    int8_t p          = ((n >> 20) != (mycounter_analyze >> 20));
+    mycounter_analyze = n;
+    // Progress of images checked at once would overwrite each other
+    if(p && !job_name) { encode_progress(); }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// NUMA placement
+//
+// On machines with more than one NUMA node, worker threads are spread over
+// the nodes in turn and each is bound to the CPUs of its node.  Images are
+// handed to whichever thread is free, and a thread allocates and first
+// writes the buffers of the image it checks, so the kernel places their
+// pages on that thread's node and a worker never reads another socket's
+// memory.  Nodes without CPUs (memory only) are skipped.
+//
+#define NUMA_MAX_NODES 64
+
+#ifdef HAVE_NUMA
+static cpu_set_t numa_cpus[NUMA_MAX_NODES];
+#endif
+static size_t numa_nodes = 0;
+
+//
+// Parse a sysfs CPU list such as "0-3,8-11"
+//
+#ifdef HAVE_NUMA
+static void numa_parse_cpulist(const char *list, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    while(*list >= '0' && *list <= '9')
+    {
+        char         *end;
+        unsigned long first = strtoul(list, &end, 10);
+        unsigned long last  = first;
+        if(*end == '-') { last = strtoul(end + 1, &end, 10); }
+        for(; first <= last && first < CPU_SETSIZE; first++) { CPU_SET(first, set); }
+        list = *end == ',' ? end + 1 : end;
+    }
+}
+#endif
+
+static void numa_init(void)
+{
+#ifdef HAVE_NUMA
+    size_t node;
+    numa_nodes = 0;
+    if(!opt_numa) { return; }
+    for(node = 0; node < NUMA_MAX_NODES; node++)
+    {
+        char  path[64];
+        char  list[1024];
+        FILE *f;
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", (unsigned)node);
+        f = fopen(path, "r");
+        if(!f) { continue; }
+        if(fgets(list, sizeof(list), f))
+        {
+            numa_parse_cpulist(list, &numa_cpus[numa_nodes]);
+            if(CPU_COUNT(&numa_cpus[numa_nodes])) { numa_nodes++; }
+        }
+        fclose(f);
+    }
+#endif
+}
+
+//
+// Bind the index-th worker thread to its node
+//
+#ifdef HAVE_PTHREADS
+static void numa_bind(pthread_t thread, size_t index)
+{
+#ifdef HAVE_NUMA
+    if(numa_nodes > 1) { pthread_setaffinity_np(thread, sizeof(cpu_set_t), &numa_cpus[index % numa_nodes]); }
+#else
+    (void)thread;
+    (void)index;
+#endif
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Worker pool
+//
+// pool_run() calls fn(ctx, index) for every index below count, spread over the
+// pool threads and the calling thread, and returns when all of them are done.
+// Without thread support everything runs on the calling thread.
+//
+typedef void (*pool_fn)(void *ctx, size_t index);
+
+typedef struct
+{
+#ifdef HAVE_PTHREADS
+    pthread_t      *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t  wake;
+    pthread_cond_t  done;
+#endif
+    size_t  nthreads;
+    pool_fn fn;
+    void   *ctx;
+    size_t  next;
+    size_t  count;
+    size_t  pending;
+    int8_t  quit;
+} workpool;
+
+#ifdef HAVE_PTHREADS
+//
+// Runs queued indexes until none are left; called and returns with lock held
+//
+static void pool_drain(workpool *pool)
+{
+    while(pool->next < pool->count)
+    {
+        pool_fn fn    = pool->fn;
+        void   *ctx   = pool->ctx;
+        size_t  index = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        fn(ctx, index);
+        pthread_mutex_lock(&pool->lock);
+        if(--pool->pending == 0) { pthread_cond_broadcast(&pool->done); }
+    }
+}
+
+static void *pool_worker(void *arg)
+{
+    workpool *pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    for(;;)
+    {
+        while(!pool->quit && pool->next >= pool->count) { pthread_cond_wait(&pool->wake, &pool->lock); }
+        if(pool->quit) { break; }
+        pool_drain(pool);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+#endif
+
+//
+// Starts nthreads helper threads; returns nonzero on error
+//
+static int8_t pool_create(workpool *pool, size_t nthreads)
+{
+    memset(pool, 0, sizeof(*pool));
+#ifdef HAVE_PTHREADS
+    if(!nthreads) { return 0; }
+    pool->threads = malloc(nthreads * sizeof(pthread_t));
+    if(!pool->threads) { return 1; }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    // The calling thread is worker 0
+    numa_bind(pthread_self(), 0);
+    for(; pool->nthreads < nthreads; pool->nthreads++)
+    {
+        if(pthread_create(&pool->threads[pool->nthreads], NULL, pool_worker, pool) != 0) { break; }
+        numa_bind(pool->threads[pool->nthreads], pool->nthreads + 1);
+    }
+#else
+    (void)nthreads;
+#endif
+    return 0;
+}
+
+static void pool_run(workpool *pool, pool_fn fn, void *ctx, size_t count)
+{
+#ifdef HAVE_PTHREADS
+    if(pool->nthreads)
+    {
+        pthread_mutex_lock(&pool->lock);
+        pool->fn      = fn;
+        pool->ctx     = ctx;
+        pool->next    = 0;
+        pool->count   = count;
+        pool->pending = count;
+        pthread_cond_broadcast(&pool->wake);
+        pool_drain(pool);
+        while(pool->pending) { pthread_cond_wait(&pool->done, &pool->lock); }
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+#endif
+    size_t i;
+    for(i = 0; i < count; i++) { fn(ctx, i); }
+}
+
+static void pool_destroy(workpool *pool)
+{
+#ifdef HAVE_PTHREADS
+    if(pool->threads)
+    {
+        size_t i;
+        pthread_mutex_lock(&pool->lock);
+        pool->quit = 1;
+        pthread_cond_broadcast(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
+        for(i = 0; i < pool->nthreads; i++) { pthread_join(pool->threads[i], NULL); }
+        pthread_cond_destroy(&pool->done);
+        pthread_cond_destroy(&pool->wake);
+        pthread_mutex_destroy(&pool->lock);
+        free(pool->threads);
+    }
+#endif
+    memset(pool, 0, sizeof(*pool));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// DVD ECC blocks
+//
+// A raw DVD recording-frame dump stores every ECC block as 16 recording frames
+// of 13 rows of 182 bytes.  Frame N holds data rows 12N..12N+11 followed by
+// outer parity row 192+N of the 208-row block.
+//
+// Every block row is a PI RS(182,172) codeword and every column of the block
+// is a PO RS(208,192) codeword, both over GF(2^8) with the 0x11D polynomial
+// also used by CD ECC and generators with roots alpha^0..alpha^(n-k-1).  A
+// codeword is valid when all of its syndromes are zero.
+//
+#define DVD_ROW_BYTES    182
+#define DVD_ROWS         208
+#define DVD_DATA_ROWS    192
+#define DVD_FRAME_ROWS   13
+#define DVD_BLOCK_BYTES  (DVD_ROW_BYTES * DVD_ROWS)
+#define DVD_PI_SYNDROMES 10
+#define DVD_PO_SYNDROMES 16
+#define DVD_BATCH_BLOCKS 64
+
+//
+// Compute nsyn syndromes of ncols codewords stored column-wise: rows[i][c] is
+// symbol i (highest power first) of codeword c, and syn[j * ncols + c] gets
+// codeword c evaluated at alpha^j.
+//
+typedef void (*dvd_syndromes_fn)(const uint8_t *const *rows, size_t nrows, size_t ncols, size_t nsyn, uint8_t *syn);
+
+static void dvd_syndromes_scalar(const uint8_t *const *rows, size_t nrows, size_t ncols, size_t nsyn, uint8_t *syn)
+{
+    size_t i;
+    size_t j;
+    size_t c;
+    memset(syn, 0, nsyn * ncols);
+    for(i = 0; i < nrows; i++)
+    {
+        const uint8_t *row = rows[i];
+        for(j = 0; j < nsyn; j++)
+        {
+            const uint8_t *mul = dvd_mul_lut[j];
+            uint8_t       *s   = syn + j * ncols;
+            for(c = 0; c < ncols; c++) { s[c] = mul[s[c]] ^ row[c]; }
+        }
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+//
+// Nibble tables for multiplying 16 symbols at once by alpha^j with PSHUFB
+//
+static uint8_t dvd_mul_lo[16][16] __attribute__((aligned(16)));
+static uint8_t dvd_mul_hi[16][16] __attribute__((aligned(16)));
+
+__attribute__((target("ssse3"))) static void
+    dvd_syndromes_ssse3(const uint8_t *const *rows, size_t nrows, size_t ncols, size_t nsyn, uint8_t *syn)
+{
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    size_t        i;
+    size_t        j;
+    size_t        c;
+    for(c = 0; c + 16 <= ncols; c += 16)
+    {
+        __m128i s[16];
+        for(j = 0; j < nsyn; j++) { s[j] = _mm_setzero_si128(); }
+        for(i = 0; i < nrows; i++)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(rows[i] + c));
+            for(j = 0; j < nsyn; j++)
+            {
+                __m128i lo = _mm_shuffle_epi8(_mm_load_si128((const __m128i *)dvd_mul_lo[j]), _mm_and_si128(s[j], mask));
+                __m128i hi = _mm_shuffle_epi8(_mm_load_si128((const __m128i *)dvd_mul_hi[j]),
+                                              _mm_and_si128(_mm_srli_epi16(s[j], 4), mask));
+                s[j]       = _mm_xor_si128(_mm_xor_si128(lo, hi), v);
+            }
+        }
+        for(j = 0; j < nsyn; j++) { _mm_storeu_si128((__m128i *)(syn + j * ncols + c), s[j]); }
+    }
+    for(; c < ncols; c++)
+    {
+        for(j = 0; j < nsyn; j++) { syn[j * ncols + c] = 0; }
+        for(i = 0; i < nrows; i++)
+        {
+            for(j = 0; j < nsyn; j++) { syn[j * ncols + c] = dvd_mul_lut[j][syn[j * ncols + c]] ^ rows[i][c]; }
+        }
+    }
+}
+#endif
+
+static dvd_syndromes_fn dvd_syndromes = dvd_syndromes_scalar;
+
+static void dvd_init(void)
+{
+    size_t i;
+    size_t j;
+    for(j = 0; j < 16; j++)
+    {
+        for(i = 0; i < 256; i++) { dvd_mul_lut[j][i] = gf_mul(i, gf_exp[j]); }
+    }
+#ifdef HAVE_X86_SIMD
+    for(j = 0; j < 16; j++)
+    {
+        for(i = 0; i < 16; i++)
+        {
+            dvd_mul_lo[j][i] = dvd_mul_lut[j][i];
+            dvd_mul_hi[j][i] = dvd_mul_lut[j][i << 4];
+        }
+    }
+#endif
+}
+
+//
+// Block row stored at the given row of the recording frames
+//
+static size_t dvd_block_row(size_t frame_row)
+{
+    size_t frame = frame_row / DVD_FRAME_ROWS;
+    size_t row   = frame_row % DVD_FRAME_ROWS;
+    return row == DVD_FRAME_ROWS - 1 ? DVD_DATA_ROWS + frame : frame * (DVD_FRAME_ROWS - 1) + row;
+}
+
+typedef struct
+{
+    const uint8_t *raw;
+    uint8_t        bad_rows[DVD_ROWS];
+    uint8_t        bad_cols[DVD_ROW_BYTES];
+    uint32_t       pi_errors;
+    uint32_t       po_errors;
+} dvd_block;
+
+static void dvd_check_block(void *ctx, size_t index)
+{
+    dvd_block     *block = (dvd_block *)ctx + index;
+    const uint8_t *rows[DVD_ROWS];
+    const uint8_t *cols[DVD_ROW_BYTES];
+    uint8_t        transposed[DVD_ROW_BYTES * DVD_ROWS];
+    uint8_t        syn[DVD_PO_SYNDROMES * DVD_ROW_BYTES];
+    size_t         r;
+    size_t         c;
+    size_t         j;
+
+    for(r = 0; r < DVD_ROWS; r++) { rows[dvd_block_row(r)] = block->raw + r * DVD_ROW_BYTES; }
+
+    //
+    // PO: the columns of the de-interleaved block
+    //
+    dvd_syndromes(rows, DVD_ROWS, DVD_ROW_BYTES, DVD_PO_SYNDROMES, syn);
+    block->po_errors = 0;
+    for(c = 0; c < DVD_ROW_BYTES; c++)
+    {
+        uint8_t any = 0;
+        for(j = 0; j < DVD_PO_SYNDROMES; j++) { any |= syn[j * DVD_ROW_BYTES + c]; }
+        block->bad_cols[c] = any != 0;
+        block->po_errors += any != 0;
+    }
+
+    //
+    // PI: transpose so every row becomes a column and reuse the same kernel
+    //
+    for(r = 0; r < DVD_ROWS; r++)
+    {
+        for(c = 0; c < DVD_ROW_BYTES; c++) { transposed[c * DVD_ROWS + r] = rows[r][c]; }
+    }
+    for(c = 0; c < DVD_ROW_BYTES; c++) { cols[c] = transposed + c * DVD_ROWS; }
+    dvd_syndromes(cols, DVD_ROW_BYTES, DVD_ROWS, DVD_PI_SYNDROMES, syn);
+    block->pi_errors = 0;
+    for(r = 0; r < DVD_ROWS; r++)
+    {
+        uint8_t any = 0;
+        for(j = 0; j < DVD_PI_SYNDROMES; j++) { any |= syn[j * DVD_ROWS + r]; }
+        block->bad_rows[r] = any != 0;
+        block->pi_errors += any != 0;
+    }
+}
+
+//
+// Returns nonzero on error
+//
+static int8_t dvdcheck(const char *infilename, workpool *pool)
+{
+    DPRINTF("Entering dvdcheck(\"%s\").\n", infilename);
+    int8_t returncode = 0;
+
+    FILE *in = NULL;
+
+    uint8_t   *buffer = NULL;
+    dvd_block *blocks = NULL;
+
+    off_t input_file_length;
+    off_t input_bytes_checked = 0;
+
+    uint32_t trailingbytes;
+
+    buffer = malloc((size_t)DVD_BATCH_BLOCKS * DVD_BLOCK_BYTES);
+    blocks = malloc(DVD_BATCH_BLOCKS * sizeof(dvd_block));
+    if(!buffer || !blocks)
+    {
+        printf("Out of memory\n");
+        goto error;
+    }
+
+    in = fopen(infilename, "rb");
+    if(!in) { goto error_in; }
+
+    printf("Checking %s...\n", infilename);
+
+    if(fseeko(in, 0, SEEK_END) != 0) { goto error_in; }
+    input_file_length = ftello(in);
+    if(input_file_length < 0) { goto error_in; }
+    if(fseeko(in, 0, SEEK_SET) != 0) { goto error_in; }
+
+    resetcounter(input_file_length);
+
+    dvdblocks      = 0;
+    dvdblockerrors = 0;
+    dvd_pi_err     = 0;
+    dvd_po_err     = 0;
+    trailingbytes  = input_file_length % DVD_BLOCK_BYTES;
+
+    while(input_file_length - input_bytes_checked >= DVD_BLOCK_BYTES)
+    {
+        size_t count = (input_file_length - input_bytes_checked) / DVD_BLOCK_BYTES;
+        size_t i;
+        if(count > DVD_BATCH_BLOCKS) { count = DVD_BATCH_BLOCKS; }
+
+        setcounter_analyze(input_bytes_checked);
+        if(fread(buffer, DVD_BLOCK_BYTES, count, in) != count) { goto error_in; }
+
+        for(i = 0; i < count; i++) { blocks[i].raw = buffer + i * DVD_BLOCK_BYTES; }
+        pool_run(pool, dvd_check_block, blocks, count);
+
+        //
+        // Report in file order once the whole batch is done
+        //
+        for(i = 0; i < count; i++)
+        {
+            const uint8_t *id = blocks[i].raw;
+            size_t         r;
+            size_t         c;
+            if(blocks[i].pi_errors || blocks[i].po_errors)
+            {
+                dvdblockerrors++;
+                dvd_pi_err += blocks[i].pi_errors;
+                dvd_po_err += blocks[i].po_errors;
+                fprintf(stderr,
+                        "ECC block with error at PSN: %02X%02X%02X (Block: %u / File Address: %06llX)\n",
+                        id[1],
+                        id[2],
+                        id[3],
+                        dvdblocks,
+                        (unsigned long long)dvdblocks * DVD_BLOCK_BYTES);
+                for(r = 0; r < DVD_ROWS; r++)
+                {
+                    if(blocks[i].bad_rows[r])
+                    {
+                        fprintf(stderr,
+                                "%02X%02X%02X: Failed PI in %s row %u\n",
+                                id[1],
+                                id[2],
+                                id[3],
+                                r < DVD_DATA_ROWS ? "data" : "PO",
+                                (unsigned)r);
+                    }
+                }
+                for(c = 0; c < DVD_ROW_BYTES; c++)
+                {
+                    if(blocks[i].bad_cols[c])
+                    { fprintf(stderr, "%02X%02X%02X: Failed PO in column %u\n", id[1], id[2], id[3], (unsigned)c); }
+                }
+            }
+            dvdblocks++;
+        }
+        input_bytes_checked += (off_t)count * DVD_BLOCK_BYTES;
+    }
+
+    //
+    // Show report
+    //
+    printf("\n-------------------Report:--------------------\n");
+    printf("ECC blocks.............. %d\n", dvdblocks);
+    printf("\twith errors........... %d\n", dvdblockerrors);
+    printf("PI rows with errors..... %d\n", dvd_pi_err);
+    printf("PO columns with errors.. %d\n", dvd_po_err);
+    if(trailingbytes) { printf("Trailing bytes.......... %d\n", trailingbytes); }
+    printf("----------------------------------------------\n");
+
+    write_dvd_csv_row(infilename, dvdblocks, dvdblockerrors, dvd_pi_err, dvd_po_err, trailingbytes);
+
+    //
+    // Success
+    //
+    printf("Done\n");
+    returncode = 0;
+    goto done;
+
+error_in:
+    printfileerror(in, infilename);
+    goto error;
+
+error:
+    returncode = 1;
+    goto done;
+
+done:
+    if(buffer != NULL) { free(buffer); }
+    if(blocks != NULL) { free(blocks); }
+    if(in != NULL) { fclose(in); }
+
+    return returncode;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Kernel dispatch
+//
+// Each facility lists its kernels fastest first.  At startup it takes the
+// first one this CPU supports, unless --kernel names another, so a single
+// portable binary runs the best code on every host.
+//
+typedef void (*kernel_fn)(void);
+
+typedef struct
+{
+    const char *name;
+    int8_t (*supported)(void);
+    kernel_fn fn;
+} kernel_entry;
+
+typedef struct
+{
+    const char         *name;
+    const kernel_entry *entries;
+    size_t              selected;
+} kernel_facility;
+
+static int8_t cpu_any(void) { return 1; }
+
+#ifdef HAVE_X86_SIMD
+static int8_t cpu_sse2(void) { return __builtin_cpu_supports("sse2") != 0; }
+static int8_t cpu_ssse3(void) { return __builtin_cpu_supports("ssse3") != 0; }
+static int8_t cpu_avx2(void) { return __builtin_cpu_supports("avx2") != 0; }
+static int8_t cpu_pclmul(void) { return __builtin_cpu_supports("sse2") && __builtin_cpu_supports("pclmul"); }
+
+static int8_t cpu_gfni(void)
+{
+    return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("gfni");
+}
+#endif
+
+static const kernel_entry edc_kernels[] = {
+#ifdef HAVE_X86_SIMD
+    {"pclmul", cpu_pclmul, (kernel_fn)edc_compute_pclmul},
+#endif
+    {"slice8", cpu_any, (kernel_fn)edc_compute_slice8},
+    {"bytewise", cpu_any, (kernel_fn)edc_compute_bytewise},
+    {NULL, NULL, NULL}};
+
+//
+// The bitsliced kernel checks whole batches; single sectors it leaves to the
+// scalar one
+//
+static const kernel_entry ecc_kernels[] = {
+#ifdef HAVE_X86_SIMD
+    {"gfni", cpu_gfni, (kernel_fn)ecc_compute_gfni},
+    {"avx2", cpu_avx2, (kernel_fn)ecc_compute_avx2},
+    {"ssse3", cpu_ssse3, (kernel_fn)ecc_compute_ssse3},
+#endif
+#ifdef HAVE_ARM_SIMD
+    {"neon", neon_supported, (kernel_fn)ecc_compute_neon},
+#endif
+    {"bitslice", cpu_any, (kernel_fn)ecc_compute_scalar},
+    {"scalar", cpu_any, (kernel_fn)ecc_compute_scalar},
+    {NULL, NULL, NULL}};
+
+static const kernel_entry dvd_kernels[] = {
+#ifdef HAVE_X86_SIMD
+    {"ssse3", cpu_ssse3, (kernel_fn)dvd_syndromes_ssse3},
+#endif
+    {"scalar", cpu_any, (kernel_fn)dvd_syndromes_scalar},
+    {NULL, NULL, NULL}};
+
+static const kernel_entry sync_kernels[] = {
+#ifdef HAVE_X86_SIMD
+    {"sse2", cpu_sse2, (kernel_fn)is_sync_sse2},
+#endif
+    {"scalar", cpu_any, (kernel_fn)is_sync_scalar},
+    {NULL, NULL, NULL}};
+
+static const kernel_entry fill_kernels[] = {
+#ifdef HAVE_X86_SIMD
+    {"avx2", cpu_avx2, (kernel_fn)is_filled_avx2},
+    {"sse2", cpu_sse2, (kernel_fn)is_filled_sse2},
+#endif
+    {"swar", cpu_any, (kernel_fn)is_filled_swar},
+    {NULL, NULL, NULL}};
+
+#define KERNEL_EDC  0
+#define KERNEL_ECC  1
+#define KERNEL_DVD  2
+#define KERNEL_SYNC 3
+#define KERNEL_FILL 4
+
+static kernel_facility kernel_facilities[] = {{"edc", edc_kernels, 0},
+                                              {"ecc", ecc_kernels, 0},
+                                              {"dvd", dvd_kernels, 0},
+                                              {"sync", sync_kernels, 0},
+                                              {"fill", fill_kernels, 0},
+                                              {NULL, NULL, 0}};
+
+static const kernel_entry *kernel_selected(size_t facility)
+{
+    return &kernel_facilities[facility].entries[kernel_facilities[facility].selected];
+}
+
+//
+// Pick the kernel called name in facility, or the first supported one for
+// "auto".  Returns nonzero, after saying why, if there is no such kernel or
+// this CPU lacks what it needs.
+//
+static int8_t kernel_pick(kernel_facility *facility, const char *name)
+{
+    size_t k;
+    int8_t automatic = !strcmp(name, "auto");
+    for(k = 0; facility->entries[k].name; k++)
+    {
+        if(!automatic && strcmp(facility->entries[k].name, name)) { continue; }
+        if(facility->entries[k].supported())
+        {
+            facility->selected = k;
+            return 0;
+        }
+        if(!automatic) { break; }
+    }
+    if(facility->entries[k].name) { printf("%s kernel %s is not supported on this system\n", facility->name, name); }
+    else
+    {
+        printf("Unknown %s kernel %s\n", facility->name, name);
+    }
+    return 1;
+}
+
+//
+// Select kernels from a comma-separated list of [facility:]name items; a
+// bare name is an ECC kernel.  Facilities not listed are picked
+// automatically.  Returns nonzero on error.
+//
+static int8_t kernel_select(const char *spec)
+{
+    size_t      f;
+    const char *item;
+    for(f = 0; kernel_facilities[f].name; f++)
+    {
+        if(kernel_pick(&kernel_facilities[f], "auto")) { return 1; }
+    }
+    for(item = spec; *item; item += (item[0] == ','))
+    {
+        char        name[32];
+        size_t      length = strcspn(item, ",");
+        const char *colon  = memchr(item, ':', length);
+        f                  = KERNEL_ECC;
+        if(colon)
+        {
+            for(f = 0; kernel_facilities[f].name; f++)
+            {
+                if(strlen(kernel_facilities[f].name) == (size_t)(colon - item) &&
+                   !strncmp(kernel_facilities[f].name, item, colon - item))
+                { break; }
+            }
+            if(!kernel_facilities[f].name)
+            {
+                printf("Unknown kernel facility %.*s\n", (int)(colon - item), item);
+                return 1;
+            }
+            length -= colon + 1 - item;
+            item = colon + 1;
+        }
+        if(length >= sizeof(name)) { length = sizeof(name) - 1; }
+        memcpy(name, item, length);
+        name[length] = 0;
+        if(kernel_pick(&kernel_facilities[f], name)) { return 1; }
+        item += strcspn(item, ",");
+    }
+
+    edc_kernel    = (edc_kernel_fn)kernel_selected(KERNEL_EDC)->fn;
+    ecc_kernel    = (ecc_kernel_fn)kernel_selected(KERNEL_ECC)->fn;
+    ecc_bitslice  = !strcmp(kernel_selected(KERNEL_ECC)->name, "bitslice");
+    dvd_syndromes = (dvd_syndromes_fn)kernel_selected(KERNEL_DVD)->fn;
+    sync_kernel   = (sync_kernel_fn)kernel_selected(KERNEL_SYNC)->fn;
+    fill_kernel   = (fill_kernel_fn)kernel_selected(KERNEL_FILL)->fn;
+    return 0;
+}
+
+//
+// Print every facility's kernels: the selected one is marked with *, those
+// this CPU cannot run are in parentheses
+//
+static void kernel_list(void)
+{
+    size_t f;
+    size_t k;
+    for(f = 0; kernel_facilities[f].name; f++)
+    {
+        printf("%-5s", kernel_facilities[f].name);
+        for(k = 0; kernel_facilities[f].entries[k].name; k++)
+        {
+            const kernel_entry *entry = &kernel_facilities[f].entries[k];
+            if(k == kernel_facilities[f].selected) { printf(" *%s", entry->name); }
+            else if(entry->supported()) { printf(" %s", entry->name); }
+            else
+            {
+                printf(" (%s)", entry->name);
+            }
+        }
+        printf("\n");
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Sector checks
+//
+// Check levels:
+//   LEVEL_EDC      EDC only; ECC is evaluated only when EDC fails, to tell
+//                  which code is damaged
+//   LEVEL_FULL     EDC, ECC and Mode 1 reserved bytes
+//   LEVEL_PARANOID also subheader semantics and MSF address continuity,
+//                  reported as warnings
+//
+#define LEVEL_EDC      0
+#define LEVEL_FULL     1
+#define LEVEL_PARANOID 2
+
+// Per thread, as batch and server jobs set it for the thread checking the image
+static THREAD_LOCAL int opt_level = LEVEL_FULL;
+
+// The --level given on the command line, the default of every job
+static int opt_cli_level = LEVEL_FULL;
+
+static THREAD_LOCAL uint32_t addresswarnings;
+static THREAD_LOCAL uint32_t subheaderwarnings;
+
+static THREAD_LOCAL int32_t previous_lba;
+static THREAD_LOCAL int8_t  previous_lba_valid;
+
+static const uint8_t zeroreserved[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+
+//
+// LBA of a sector from its BCD minutes:seconds:frames address
+//
+static int32_t sector_lba(const uint8_t *sector)
+{
+    return (((((sector[0x00C] >> 4) * 10) + (sector[0x00C] & 0x0F)) * 60) +
+            (((sector[0x00D] >> 4) * 10) + (sector[0x00D] & 0x0F)) - 2) *
+               75 +
+           (((sector[0x00E] >> 4) * 10) + (sector[0x00E] & 0x0F));
+}
+
+static void print_sector_event(const char *what, const uint8_t *sector, const char *suffix)
+{
+    if(job_event)
+    {
+        char text[256];
+        snprintf(text, sizeof(text), "%s%s", what, suffix);
+        job_event(job_event_ctx, sector, text);
+        return;
+    }
+    fprintf(stderr,
+            "%s%s%s at address: %02X:%02X:%02X (LBA: %d / File Address: %06X)%s\n",
+            job_name ? job_name : "",
+            job_name ? ": " : "",
+            what,
+            sector[0x00C],
+            sector[0x00D],
+            sector[0x00E],
+            sector_lba(sector),
+            sector_lba(sector) * 2352,
+            suffix);
+}
+
+static void print_sector_failure(const uint8_t *sector, const char *what)
+{
+    if(job_event)
+    {
+        char text[256];
+        snprintf(text, sizeof(text), "Failed %s", what);
+        job_event(job_event_ctx, sector, text);
+        return;
+    }
+    fprintf(stderr,
+            "%s%s%02X:%02X:%02X: Failed %s\n",
+            job_name ? job_name : "",
+            job_name ? ": " : "",
+            sector[0x00C],
+            sector[0x00D],
+            sector[0x00E],
+            what);
+}
+
+//
+// Paranoid: the address must be valid BCD and follow the previous data sector
+//
+static void check_address(const uint8_t *sector)
+{
+    int32_t lba = sector_lba(sector);
+    int8_t  bcd = (sector[0x00C] & 0x0F) < 10 && (sector[0x00C] >> 4) < 10 && (sector[0x00D] & 0x0F) < 10 &&
+                 sector[0x00D] < 0x60 && (sector[0x00E] & 0x0F) < 10 && sector[0x00E] < 0x75;
+    if(!bcd)
+    {
+        addresswarnings++;
+        totalwarnings++;
+        print_sector_event("Invalid BCD address in sector", sector, "");
+    }
+    else if(previous_lba_valid && lba != previous_lba + 1)
+    {
+        addresswarnings++;
+        totalwarnings++;
+        print_sector_event("Address discontinuity in sector", sector, "");
+    }
+    previous_lba       = lba;
+    previous_lba_valid = bcd;
+}
+
+//
+// Paranoid: the Mode 2 subheader must describe a sensible sector
+//
+static int8_t subheader_valid(const uint8_t *sector)
+{
+    uint8_t submode = sector[0x012];
+    uint8_t kinds   = ((submode >> 1) & 1) + ((submode >> 2) & 1) + ((submode >> 3) & 1); // video, audio, data
+    if(sector[0x011] >= 32) { return 0; }   // channel number
+    if(kinds > 1) { return 0; }
+    if(sector[0x013] & 0x80) { return 0; }  // reserved coding information bit
+    if((submode & 0x08) && sector[0x013]) { return 0; } // data sectors have no coding information
+    return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Known-pattern fast path
+//
+// Long stretches of discs are sectors whose user data is one repeated byte
+// (00h padding and pregaps, 55h placeholders).  EDC and ECC are linear, so
+// for those they split into a constant for the fill plus terms for the few
+// bytes around it (address, subheader, EDC), all precomputed at startup.
+// Such sectors are checked with a compare and a handful of lookups instead
+// of the EDC and ECC kernels.
+//
+#define KNOWN_FILLS 2
+#define KNOWN_TERMS 12
+
+static const uint8_t known_fill_bytes[KNOWN_FILLS] = {0x00, 0x55};
+
+//
+// ECC bytes changed by a 1 at some position; a value x changes them by
+// x times coef
+//
+typedef struct
+{
+    uint16_t index[KNOWN_TERMS];
+    uint8_t  coef[KNOWN_TERMS];
+    size_t   count;
+} known_term;
+
+static uint32_t   known_edc_2048[KNOWN_FILLS];
+static uint32_t   known_edc_2324[KNOWN_FILLS];
+static uint32_t   edc_advance_2048[4][256];
+static uint32_t   edc_advance_2324[4][256];
+static uint8_t    known_ecc_mode1[KNOWN_FILLS][ECC_BYTES];
+static uint8_t    known_ecc_m2f1[KNOWN_FILLS][ECC_BYTES];
+static known_term known_terms_mode1[8];
+static known_term known_terms_m2f1[12];
+
+//
+// Write P and Q for a sector, Q covering the fresh P
+//
+static void ecc_generate(const uint8_t *address, uint8_t *data)
+{
+    ecc_computepq(address, data, 86, 24, 2, 86, data + 0x80C);
+    ecc_computepq(address, data, 52, 43, 86, 88, data + 0x80C + 0xAC);
+}
+
+//
+// Fill table so that edc_advance() moves an EDC past size zero bytes
+//
+static void edc_advance_init(uint32_t table[4][256], size_t size)
+{
+    uint32_t bit[32];
+    size_t   b;
+    size_t   k;
+    size_t   v;
+    for(b = 0; b < 32; b++)
+    {
+        uint32_t edc = ((uint32_t)1) << b;
+        for(k = 0; k < size; k++) { edc = (edc >> 8) ^ edc_lut[edc & 0xFF]; }
+        bit[b] = edc;
+    }
+    for(k = 0; k < 4; k++)
+    {
+        for(v = 0; v < 256; v++)
+        {
+            table[k][v] = 0;
+            for(b = 0; b < 8; b++)
+            {
+                if(v & (1 << b)) { table[k][v] ^= bit[8 * k + b]; }
+            }
+        }
+    }
+}
+
+static uint32_t edc_advance(uint32_t table[4][256], uint32_t edc)
+{
+    return table[0][edc & 0xFF] ^ table[1][(edc >> 8) & 0xFF] ^ table[2][(edc >> 16) & 0xFF] ^ table[3][edc >> 24];
+}
+
+//
+// Record the ECC bytes that depend on ECC input byte position
+//
+static void known_term_init(known_term *term, size_t position)
+{
+    uint8_t address[4];
+    uint8_t data[0x920];
+    size_t  i;
+    memset(address, 0, sizeof(address));
+    memset(data, 0, sizeof(data));
+    if(position < 4) { address[position] = 1; }
+    else
+    {
+        data[position - 4] = 1;
+    }
+    ecc_generate(address, data);
+    term->count = 0;
+    for(i = 0; i < ECC_BYTES; i++)
+    {
+        if(data[0x80C + i] && term->count < KNOWN_TERMS)
+        {
+            term->index[term->count] = i;
+            term->coef[term->count]  = data[0x80C + i];
+            term->count++;
+        }
+    }
+}
+
+static void known_init(void)
+{
+    uint8_t data[0x920];
+    size_t  f;
+    size_t  i;
+
+    edc_advance_init(edc_advance_2048, 0x800);
+    edc_advance_init(edc_advance_2324, 0x914);
+
+    for(f = 0; f < KNOWN_FILLS; f++)
+    {
+        memset(data, known_fill_bytes[f], sizeof(data));
+        known_edc_2048[f] = edc_compute_bytewise(0, data, 0x800);
+        known_edc_2324[f] = edc_compute_bytewise(0, data, 0x914);
+
+        // Mode 1: address and EDC zero, reserved bytes always zero
+        memset(data, 0, sizeof(data));
+        memset(data, known_fill_bytes[f], 0x800);
+        ecc_generate(zeroaddress, data);
+        memcpy(known_ecc_mode1[f], data + 0x80C, ECC_BYTES);
+
+        // Mode 2 form 1: subheader and EDC zero
+        memset(data, 0, sizeof(data));
+        memset(data + 8, known_fill_bytes[f], 0x800);
+        ecc_generate(zeroaddress, data);
+        memcpy(known_ecc_m2f1[f], data + 0x80C, ECC_BYTES);
+    }
+
+    for(i = 0; i < 4; i++)
+    {
+        known_term_init(&known_terms_mode1[i], i);                 // address
+        known_term_init(&known_terms_mode1[4 + i], 4 + 0x800 + i); // EDC
+    }
+    for(i = 0; i < 8; i++) { known_term_init(&known_terms_m2f1[i], 4 + i); } // subheader
+    for(i = 0; i < 4; i++) { known_term_init(&known_terms_m2f1[8 + i], 4 + 0x808 + i); } // EDC
+}
+
+//
+// Index of the known fill byte all size bytes at src equal, or -1
+//
+static int known_fill(const uint8_t *src, size_t size)
+{
+    int f;
+    for(f = 0; f < KNOWN_FILLS; f++)
+    {
+        if(src[0] == known_fill_bytes[f]) { return is_filled(src, size, known_fill_bytes[f]) ? f : -1; }
+    }
+    return -1;
+}
+
+//
+// Returns true if the stored ECC matches base plus the terms for values
+//
+static int8_t known_ecc_ok(const uint8_t   *base,
+                           const known_term *terms,
+                           const uint8_t   *values,
+                           size_t           count,
+                           const uint8_t   *ecc)
+{
+    uint8_t expected[ECC_BYTES];
+    size_t  i;
+    size_t  k;
+    memcpy(expected, base, ECC_BYTES);
+    for(i = 0; i < count; i++)
+    {
+        if(!values[i]) { continue; }
+        for(k = 0; k < terms[i].count; k++) { expected[terms[i].index[k]] ^= gf_mul(values[i], terms[i].coef[k]); }
+    }
+    return !memcmp(expected, ecc, ECC_BYTES);
+}
+
+//
+// Returns true if a Mode 1 sector whose user data is known fill f is
+// entirely correct (EDC, reserved bytes, ECC)
+//
+static int8_t known_mode1_ok(const uint8_t *sector, int f)
+{
+    uint8_t values[8];
+    if(memcmp(sector + 0x814, zeroreserved, sizeof(zeroreserved)) != 0) { return 0; }
+    if((edc_advance(edc_advance_2048, edc_compute_bytewise(0, sector, 0x10)) ^ known_edc_2048[f]) !=
+       get32lsb(sector + 0x810))
+    { return 0; }
+    memcpy(values, sector + 0xC, 4);
+    memcpy(values + 4, sector + 0x810, 4);
+    return known_ecc_ok(known_ecc_mode1[f], known_terms_mode1, values, 8, sector + 0x81C);
+}
+
+//
+// Same for Mode 2 form 1 (EDC and ECC)
+//
+static int8_t known_m2f1_ok(const uint8_t *m2sec, int f)
+{
+    uint8_t values[12];
+    if((edc_advance(edc_advance_2048, edc_compute_bytewise(0, m2sec, 8)) ^ known_edc_2048[f]) != get32lsb(m2sec + 0x808))
+    { return 0; }
+    memcpy(values, m2sec, 8);
+    memcpy(values + 8, m2sec + 0x808, 4);
+    return known_ecc_ok(known_ecc_m2f1[f], known_terms_m2f1, values, 12, m2sec + 0x80C);
+}
+
+//
+// Same for Mode 2 form 2 (EDC only, which may be omitted)
+//
+static int8_t known_m2f2_ok(const uint8_t *m2sec, int f)
+{
+    uint32_t edc = get32lsb(m2sec + 0x91C);
+    return edc == 0 ||
+           (edc_advance(edc_advance_2324, edc_compute_bytewise(0, m2sec, 8)) ^ known_edc_2324[f]) == edc;
+}
+
+static void check_mode0(const uint8_t *sector)
+{
+    mode0sectors++;
+    if(!is_filled(sector + 0x010, 0x920, 0x00))
+    {
+        mode0errors++;
+        totalerrors++;
+        print_sector_event("Mode 0 sector with error", sector, "");
+    }
+}
+
+static void check_mode1(const uint8_t *sector, uint32_t sectornumber, const ecc_batch *batch)
+{
+    int    fill        = known_fill(sector + 0x010, 0x800);
+    int8_t edc_ok      = 1;
+    int8_t reserved_ok = 1;
+    int8_t ecc_ok      = 1;
+
+    mode1sectors++;
+
+    if(fill < 0 || !known_mode1_ok(sector, fill))
+    {
+        edc_ok      = edc_compute(0, sector, 0x810) == get32lsb(sector + 0x810);
+        reserved_ok = opt_level < LEVEL_FULL || !memcmp(sector + 0x814, zeroreserved, sizeof(zeroreserved));
+
+        //
+        // EDC and the reserved bytes are cheap; ECC is only needed if they pass
+        //
+        if(edc_ok && reserved_ok && opt_level >= LEVEL_FULL)
+        { ecc_ok = ecc_batch_check(batch, sectornumber, sector + 0xC, sector + 0x10, sector + 0x81C); }
+    }
+
+    if(!edc_ok || !reserved_ok || !ecc_ok)
+    {
+        mode1errors++;
+        totalerrors++;
+        print_sector_event("Mode 1 sector with error", sector, "");
+
+        if(!edc_ok)
+        {
+            print_sector_failure(sector, "EDC");
+            total_edc_err++;
+            mode1_edc_err++;
+        }
+        if(!ecc_checkpq(sector + 0xC, sector + 0x10, 86, 24, 2, 86, sector + 0x81C))
+        {
+            print_sector_failure(sector, "ECC P");
+            total_ecc_p_err++;
+            mode1_ecc_p_err++;
+        }
+        if(!ecc_checkpq(sector + 0xC, sector + 0x10, 52, 43, 86, 88, sector + 0x81C + 0xAC))
+        {
+            print_sector_failure(sector, "ECC Q");
+            total_ecc_q_err++;
+            mode1_ecc_q_err++;
+        }
+    }
+
+    if(fill >= 0 && known_fill_bytes[fill] == 0x55)
+    {
+        filledsectors++;
+        print_sector_event("Mode 1 sector", sector, " is filled with 55h");
+    }
+}
+
+static void check_mode2(const uint8_t *sector, uint32_t sectornumber, const ecc_batch *batch)
+{
+    const uint8_t *m2sec = sector + 0x10;
+    int8_t         copies_ok =
+        sector[0x010] == sector[0x014] && sector[0x011] == sector[0x015] && sector[0x012] == sector[0x016] &&
+        sector[0x013] == sector[0x017];
+
+    if((sector[0x012] & 0x20) == 0x20) // mode 2 form 2
+    {
+        int      fill   = known_fill(sector + 0x018, 0x914);
+        uint32_t edc    = get32lsb(m2sec + 0x91C);
+        int8_t   edc_ok = fill >= 0 && known_m2f2_ok(m2sec, fill);
+        if(!edc_ok) { edc_ok = edc == 0 || edc_compute(0, m2sec, 0x91C) == edc; } // EDC is optional in form 2
+
+        mode2f2sectors++;
+        if(!edc_ok)
+        {
+            print_sector_event("Mode 2 form 2 sector with error", sector, "");
+            print_sector_failure(sector, "EDC");
+            total_edc_err++;
+            mode2f2_edc_err++;
+            mode2f2errors++;
+            totalerrors++;
+        }
+        if(!copies_ok)
+        {
+            mode2f2warnings++;
+            totalwarnings++;
+            print_sector_event("Subheader copies differ in mode 2 form 2 sector", sector, "");
+        }
+        if(opt_level >= LEVEL_PARANOID && !subheader_valid(sector))
+        {
+            mode2f2warnings++;
+            subheaderwarnings++;
+            totalwarnings++;
+            print_sector_event("Invalid subheader in mode 2 form 2 sector", sector, "");
+        }
+
+        if(fill >= 0 ? known_fill_bytes[fill] == 0x55 : is_filled(sector + 0x018, 0x904, 0x55))
+        {
+            filledsectors++;
+            print_sector_event("Mode 2 form 2 sector", sector, " is filled with 55h");
+        }
+    }
+    else
+    {
+        int    fill   = known_fill(sector + 0x018, 0x800);
+        int8_t edc_ok = 1;
+        int8_t ecc_ok = 1;
+
+        mode2f1sectors++;
+        if(fill < 0 || !known_m2f1_ok(m2sec, fill))
+        {
+            edc_ok = edc_compute(0, m2sec, 0x808) == get32lsb(m2sec + 0x808);
+            if(edc_ok && opt_level >= LEVEL_FULL)
+            { ecc_ok = ecc_batch_check(batch, sectornumber, zeroaddress, m2sec, m2sec + 0x80C); }
+        }
+
+        if(!edc_ok || !ecc_ok)
+        {
+            print_sector_event("Mode 2 form 1 sector with error", sector, "");
+            if(!edc_ok)
+            {
+                print_sector_failure(sector, "EDC");
+                total_edc_err++;
+                mode2f1_edc_err++;
+            }
+            if(!ecc_checkpq(zeroaddress, m2sec, 86, 24, 2, 86, m2sec + 0x80C))
+            {
+                print_sector_failure(sector, "ECC P");
+                total_ecc_p_err++;
+                mode2f1_ecc_p_err++;
+            }
+            if(!ecc_checkpq(zeroaddress, m2sec, 52, 43, 86, 88, m2sec + 0x80C + 0xAC))
+            {
+                print_sector_failure(sector, "ECC Q");
+                total_ecc_q_err++;
+                mode2f1_ecc_q_err++;
+            }
+            mode2f1errors++;
+            totalerrors++;
+        }
+        if(!copies_ok)
+        {
+            mode2f1warnings++;
+            totalwarnings++;
+            print_sector_event("Subheader copies differ in mode 2 form 1 sector", sector, "");
+        }
+        if(opt_level >= LEVEL_PARANOID && !subheader_valid(sector))
+        {
+            mode2f1warnings++;
+            subheaderwarnings++;
+            totalwarnings++;
+            print_sector_event("Invalid subheader in mode 2 form 1 sector", sector, "");
+        }
+
+        if(fill >= 0 && known_fill_bytes[fill] == 0x55)
+        {
+            filledsectors++;
+            print_sector_event("Mode 2 form 1 sector", sector, " is filled with 55h");
+        }
+    }
+}
+
+static void check_sector(const uint8_t *sector, uint32_t sectornumber, const ecc_batch *batch)
+{
+    // Data sector
+    if(!is_sync(sector))
+    {
+        DPRINTF("check_sector(): Non-data sector.\n");
+        nondatasectors++;
+        previous_lba_valid = 0;
+        return;
+    }
+    if(sector[0x00F] > 0x02) // Unknown sector mode!!!
+    {
+        DPRINTF("check_sector(): Unknown data sector with mode %d at address %02X:%02X:%02X.\n",
+                sector[0x00F],
+                sector[0x00C],
+                sector[0x00D],
+                sector[0x00E]);
+        nondatasectors++;
+        previous_lba_valid = 0;
+        return;
+    }
+
+    DPRINTF("check_sector(): Mode %d sector at address %02X:%02X:%02X.\n",
+            sector[0x00F],
+            sector[0x00C],
+            sector[0x00D],
+            sector[0x00E]);
+    if(opt_level >= LEVEL_PARANOID) { check_address(sector); }
+    switch(sector[0x00F]) // mode (1 byte)
+    {
+        case 0x00: check_mode0(sector); break;
+        case 0x01: check_mode1(sector, sectornumber, batch); break;
+        default: check_mode2(sector, sectornumber, batch); break;
+    }
+}
+
+//
+// Whether a sector passes all its checks, without counting or reporting
+// anything: 1 if it does, 0 if it doesn't, -1 if it has nothing to check
+// (audio and unknown modes, and form 2 sectors without EDC)
+//
+static int sector_verify(const uint8_t *sector)
+{
+    const uint8_t *m2sec = sector + 0x10;
+    uint32_t       edc;
+
+    if(!is_sync(sector) || sector[0x00F] > 0x02) { return -1; }
+    switch(sector[0x00F])
+    {
+        case 0x00: return is_filled(sector + 0x010, 0x920, 0x00);
+        case 0x01:
+            return edc_compute(0, sector, 0x810) == get32lsb(sector + 0x810) &&
+                   !memcmp(sector + 0x814, zeroreserved, sizeof(zeroreserved)) &&
+                   ecc_checksector(sector + 0xC, sector + 0x10, sector + 0x81C);
+        default: break;
+    }
+    if((sector[0x012] & 0x20) == 0x20)
+    {
+        edc = get32lsb(m2sec + 0x91C);
+        return edc ? edc_compute(0, m2sec, 0x91C) == edc : -1;
+    }
+    return edc_compute(0, m2sec, 0x808) == get32lsb(m2sec + 0x808) &&
+           ecc_checksector(zeroaddress, m2sec, m2sec + 0x80C);
+}
+
+//
+// Correct a single wrong byte in one P or Q codeword of the n bytes of data
+// at pos; bytes below protect are known to be right (the zero address of
+// Mode 2).  The two check bytes of a codeword give its syndromes
+//
+//   S0 = sum of c[k]   and   S1 = sum of c[k] * a^(n-1-k)
+//
+// which are both zero for a right codeword; with one wrong byte at k, S0
+// is the error and S1/S0 = a^(n-1-k) gives k.
+// Returns 0 if the codeword was right, 1 if it was corrected, -1 if not
+//
+static int ecc_correct_codeword(uint8_t *data, const size_t *pos, size_t n, size_t protect)
+{
+    uint8_t s0 = 0;
+    uint8_t s1 = 0;
+    size_t  e;
+    size_t  k;
+
+    for(k = 0; k < n; k++)
+    {
+        s0 ^= data[pos[k]];
+        s1 = ecc_f_lut[s1] ^ data[pos[k]];
+    }
+    if(!s0 && !s1) { return 0; }
+    if(!s0 || !s1) { return -1; }
+    e = (gf_log[s1] + 255 - gf_log[s0]) % 255;
+    if(e >= n || pos[n - 1 - e] < protect) { return -1; }
+    data[pos[n - 1 - e]] ^= s0;
+    return 1;
+}
+
+//
+// Correct what the P and Q codes of a Mode 1 or Mode 2 form 1 sector can,
+// alternating P and Q passes while they still correct something, as each
+// can fix bytes that left the other with two wrong bytes in a codeword.
+// Returns nonzero if the sector then passes all its checks
+//
+static int8_t ecc_repair(uint8_t *sector)
+{
+    uint8_t *data  = sector + 0xC;
+    int8_t   mode2 = sector[0x00F] == 0x02;
+    uint8_t  address[4];
+    size_t   pos[45];
+    size_t   round;
+    size_t   major;
+    size_t   k;
+
+    if(!is_sync(sector) || sector[0x00F] < 0x01 || sector[0x00F] > 0x02) { return 0; }
+    if(mode2 && (sector[0x012] & 0x20) && (sector[0x016] & 0x20)) { return 0; } // form 2 has no ECC
+
+    // Mode 2 codes are computed with the address taken as zero
+    memcpy(address, data, 4);
+    if(mode2) { memset(data, 0, 4); }
+    for(round = 0; round < 4; round++)
+    {
+        int8_t corrected = 0;
+        for(major = 0; major < 86; major++)
+        {
+            for(k = 0; k < 26; k++) { pos[k] = major + 86 * k; }
+            corrected |= ecc_correct_codeword(data, pos, 26, mode2 ? 4 : 0) > 0;
+        }
+        for(major = 0; major < 52; major++)
+        {
+            for(k = 0; k < 43; k++) { pos[k] = ((major >> 1) * 86 + (major & 1) + 88 * k) % 2236; }
+            pos[43] = 2236 + major;
+            pos[44] = 2236 + 52 + major;
+            corrected |= ecc_correct_codeword(data, pos, 45, mode2 ? 4 : 0) > 0;
+        }
+        if(!corrected) { break; }
+    }
+    if(mode2) { memcpy(data, address, 4); }
+    return sector_verify(sector) == 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Devices
+//
+// A batch run checks several images at once, one per worker thread.  Images
+// are grouped by the device they are stored on.  On a rotational device only
+// opt_device_readers of them read at a time, in larger blocks, so that the
+// heads stream instead of seeking between files; checking what has been read
+// goes on in parallel.  Reads from SSDs, network file systems and devices
+// that can't be identified are not limited.
+//
+#define ROTATIONAL_READ_SIZE 0x800000
+
+typedef struct
+{
+    dev_t  dev;
+    int8_t rotational;
+    size_t readers;
+#ifdef HAVE_PTHREADS
+    pthread_mutex_t lock;
+    pthread_cond_t  idle;
+#endif
+} io_device;
+
+static THREAD_LOCAL io_device *job_device = NULL;
+
+#ifdef HAVE_PTHREADS
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+//
+// Nonzero if the block device dev is a spinning disk
+//
+static int8_t device_rotational(dev_t dev)
+{
+#if defined(__linux__)
+    char  path[80];
+    FILE *f;
+    int   c = '0';
+
+    // Partitions have no queue of their own; theirs is the parent disk's
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/rotational", major(dev), minor(dev));
+    f = fopen(path, "r");
+    if(!f)
+    {
+        snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../queue/rotational", major(dev), minor(dev));
+        f = fopen(path, "r");
+    }
+    if(f)
+    {
+        c = fgetc(f);
+        fclose(f);
+    }
+    return c == '1';
+#else
+    (void)dev;
+    return 0;
+#endif
+}
+
+//
+// Wait for a turn to read from the device of the current job
+//
+static void device_read_begin(void)
+{
+    io_device *d = job_device;
+    if(!d || !d->rotational) { return; }
+#ifdef HAVE_PTHREADS
+    pthread_mutex_lock(&d->lock);
+    while(d->readers >= opt_device_readers) { pthread_cond_wait(&d->idle, &d->lock); }
+    d->readers++;
+    pthread_mutex_unlock(&d->lock);
+#endif
+}
+
+static void device_read_end(void)
+{
+    io_device *d = job_device;
+    if(!d || !d->rotational) { return; }
+#ifdef HAVE_PTHREADS
+    pthread_mutex_lock(&d->lock);
+    d->readers--;
+    pthread_cond_signal(&d->idle);
+    pthread_mutex_unlock(&d->lock);
+#endif
+}
+
+//
+// Keep the output of a job together while it is printed
+//
+static void output_begin(void)
+{
+#ifdef HAVE_PTHREADS
+    pthread_mutex_lock(&output_lock);
+#endif
+}
+
+static void output_end(void)
+{
+    fflush(stdout);
+#ifdef HAVE_PTHREADS
+    pthread_mutex_unlock(&output_lock);
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Throttling
+//
+// --max-read-rate limits the reads of all threads together with a token
+// bucket holding up to a second's worth of bytes.  A read may take more
+// tokens than there are; the reader then sleeps until the debt has been
+// paid back, outside the lock so that other readers queue up behind it in
+// turn.
+//
+static double throttle_tokens = 0;
+static double throttle_last   = -1;
+#ifdef HAVE_PTHREADS
+static pthread_mutex_t throttle_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+//
+// Seconds on a monotonic clock
+//
+static double throttle_now(void)
+{
+#if defined(_WIN32)
+    return GetTickCount64() / 1000.0;
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+    return (double)time(NULL);
+#endif
+}
+
+static void throttle_sleep(double seconds)
+{
+#if defined(_WIN32)
+    Sleep((DWORD)(seconds * 1000));
+#else
+    struct timespec ts;
+    ts.tv_sec  = (time_t)seconds;
+    ts.tv_nsec = (long)((seconds - ts.tv_sec) * 1e9);
+    while(nanosleep(&ts, &ts) != 0 && errno == EINTR) {}
+#endif
+}
+
+//
+// Wait until bytes may be read
+//
+static void throttle_read(size_t bytes)
+{
+    double rate = opt_max_read_rate * 1000000;
+    double now;
+    double wait;
+
+    if(rate <= 0) { return; }
+#ifdef HAVE_PTHREADS
+    pthread_mutex_lock(&throttle_lock);
+#endif
+    now = throttle_now();
+    if(throttle_last < 0) { throttle_tokens = rate; }
+    else
+    {
+        throttle_tokens += (now - throttle_last) * rate;
+    }
+    if(throttle_tokens > rate) { throttle_tokens = rate; }
+    throttle_last = now;
+    throttle_tokens -= bytes;
+    wait = throttle_tokens < 0 ? -throttle_tokens / rate : 0;
+#ifdef HAVE_PTHREADS
+    pthread_mutex_unlock(&throttle_lock);
+#endif
+    if(wait > 0) { throttle_sleep(wait); }
+}
+
+//
+// Lower the priority of the process, before any worker thread is started
+// so that they inherit it
+//
+static void background_init(void)
+{
+#if defined(_WIN32)
+    SetPriorityClass(GetCurrentProcess(), PROCESS_MODE_BACKGROUND_BEGIN);
+#else
+#if defined(__linux__) && defined(SYS_ioprio_set)
+    // IOPRIO_WHO_PROCESS, IOPRIO_CLASS_IDLE
+    syscall(SYS_ioprio_set, 1, 0, 3 << 13);
+#endif
+#if defined(_POSIX_VERSION)
+    setpriority(PRIO_PROCESS, 0, 19);
+#endif
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Sampling
+//
+// The image is cut into as many equal strata as there are sectors to
+// sample, and one sector at a random position in each stratum is read and
+// checked.  The fraction of sampled sectors with errors estimates that of
+// the whole image.  Its confidence interval is the 95% Wilson score
+// interval, narrowed by the finite population correction as the sample
+// covers more of the image.
+//
+static THREAD_LOCAL uint64_t sample_state;
+
+//
+// xorshift64*
+//
+static uint64_t sample_random(void)
+{
+    sample_state ^= sample_state >> 12;
+    sample_state ^= sample_state << 25;
+    sample_state ^= sample_state >> 27;
+    return sample_state * 0x2545F4914F6CDD1DULL;
+}
+
+//
+// Number of the image's sectors to check
+//
+static uint32_t sample_count(uint32_t imagesectors)
+{
+    double count;
+    if(opt_sample_sectors) { count = opt_sample_sectors; }
+    else if(opt_sample_percent > 0) { count = ceil(imagesectors * opt_sample_percent / 100); }
+    else
+    {
+        return imagesectors;
+    }
+    if(count < 1) { count = 1; }
+    return count < imagesectors ? (uint32_t)count : imagesectors;
+}
+
+//
+// Check count sectors spread over the imagesectors sectors from firstsector
+// on with positioned reads, picked from seed
+// Returns nonzero on error
+//
+static int8_t sample_sectors(FILE *in, uint32_t firstsector, uint32_t imagesectors, uint32_t count, uint64_t seed)
+{
+    uint8_t   sector[2352];
+    ecc_batch batch;
+    uint32_t  s;
+
+    memset(&batch, 0, sizeof(batch));
+    sample_state = (seed << 1) | 1;
+
+    for(s = 0; s < count; s++)
+    {
+        uint32_t first = (uint32_t)((uint64_t)imagesectors * s / count);
+        uint32_t next  = (uint32_t)((uint64_t)imagesectors * (s + 1) / count);
+        uint32_t lba   = firstsector + first + (uint32_t)(sample_random() % (next - first));
+
+        setcounter_analyze((off_t)lba * 2352);
+        throttle_read(sizeof(sector));
+        device_read_begin();
+        if(fseeko(in, (off_t)lba * 2352, SEEK_SET) != 0 || fread(sector, 1, sizeof(sector), in) != sizeof(sector))
+        {
+            device_read_end();
+            return 1;
+        }
+        device_read_end();
+
+        previous_lba_valid = 0;
+        check_sector(sector, lba, &batch);
+        totalsectors++;
+    }
+    return 0;
+}
+
+//
+// Estimate the image's error rate and its confidence interval from errors
+// found in sampled of imagesectors sectors
+//
+static void sample_estimate(uint32_t errors,
+                            uint32_t sampled,
+                            uint32_t imagesectors,
+                            double  *rate,
+                            double  *low,
+                            double  *high)
+{
+    const double z = 1.96;
+    double       n = sampled;
+    double       center;
+    double       half;
+
+    *rate = *low = *high = 0;
+    if(!sampled) { return; }
+    *rate = *low = *high = errors / n;
+    if(sampled >= imagesectors) { return; }
+
+    n      = n * (imagesectors - 1) / (imagesectors - sampled);
+    center = (*rate + z * z / (2 * n)) / (1 + z * z / n);
+    half   = z * sqrt(*rate * (1 - *rate) / n + z * z / (4 * n * n)) / (1 + z * z / n);
+    *low   = center - half > 0 ? center - half : 0;
+    *high  = center + half < 1 ? center + half : 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Partial results
+//
+// A run over part of an image (--start-lba/--end-lba, --shard) can save its
+// counters with --partial.  "edccchk merge" adds the counters of the parts
+// back up and prints the same report and CSV row as a run over the whole
+// image.  The format is plain text, one "key value" pair per line, after a
+// "edccchk partial 1" header line.
+//
+//
+// The counters are thread-local, so they are listed by name here rather
+// than in a table of addresses
+//
+#define CD_COUNTERS(X)                                                                                               \
+    X(nondatasectors)                                                                                                \
+    X(mode0sectors)                                                                                                  \
+    X(mode0errors)                                                                                                   \
+    X(mode1sectors)                                                                                                  \
+    X(mode1errors)                                                                                                   \
+    X(mode2f1sectors)                                                                                                \
+    X(mode2f1errors)                                                                                                 \
+    X(mode2f1warnings)                                                                                               \
+    X(mode2f2sectors)                                                                                                \
+    X(mode2f2errors)                                                                                                 \
+    X(mode2f2warnings)                                                                                               \
+    X(totalsectors)                                                                                                  \
+    X(totalerrors)                                                                                                   \
+    X(totalwarnings)                                                                                                 \
+    X(filledsectors)                                                                                                 \
+    X(addresswarnings)                                                                                               \
+    X(subheaderwarnings)                                                                                             \
+    X(total_ecc_p_err)                                                                                               \
+    X(total_ecc_q_err)                                                                                               \
+    X(total_edc_err)                                                                                                 \
+    X(mode1_ecc_p_err)                                                                                               \
+    X(mode1_ecc_q_err)                                                                                               \
+    X(mode1_edc_err)                                                                                                 \
+    X(mode2f1_ecc_p_err)                                                                                             \
+    X(mode2f1_ecc_q_err)                                                                                             \
+    X(mode2f1_edc_err)                                                                                               \
+    X(mode2f2_edc_err)
+
+enum
+{
+#define CD_COUNTER_ENUM(name) CD_COUNTER_##name,
+    CD_COUNTERS(CD_COUNTER_ENUM)
+#undef CD_COUNTER_ENUM
+    CD_COUNTER_COUNT
+};
+
+//
+// Sectors first..end-1 of an image of filesectors sectors, of which
+// imagesectors could be checked (all of them unless sampling), with the
+// paranoid address state after the first sector and after the last, so
+// that merging parts can check the address continuity where they meet
+//
+typedef struct
+{
+    uint32_t first;
+    uint32_t end;
+    uint32_t filesectors;
+    uint32_t imagesectors;
+    int32_t  lba_in;
+    int32_t  lba_out;
+    int8_t   valid_in;
+    int8_t   valid_out;
+} cd_range;
+
+static void cd_counters_reset(void)
+{
+#define CD_COUNTER_RESET(name) name = 0;
+    CD_COUNTERS(CD_COUNTER_RESET)
+#undef CD_COUNTER_RESET
+}
+
+static void cd_counters_get(uint32_t values[CD_COUNTER_COUNT])
+{
+#define CD_COUNTER_GET(name) values[CD_COUNTER_##name] = name;
+    CD_COUNTERS(CD_COUNTER_GET)
+#undef CD_COUNTER_GET
+}
+
+static void cd_counters_add(const uint32_t values[CD_COUNTER_COUNT])
+{
+#define CD_COUNTER_ADD(name) name += values[CD_COUNTER_##name];
+    CD_COUNTERS(CD_COUNTER_ADD)
+#undef CD_COUNTER_ADD
+}
+
+//
+// Returns nonzero on error
+//
+static int8_t write_partial(const char *filename, const char *infilename, const cd_range *range)
+{
+    FILE *out;
+
+    out = fopen(filename, "w");
+    if(!out) { goto error; }
+    fprintf(out, "edccchk partial 1\n");
+    fprintf(out, "image %s\n", infilename);
+    fprintf(out, "range %u %u %u %u\n", range->first, range->end, range->filesectors, range->imagesectors);
+    fprintf(out, "address %d %d %d %d\n", range->lba_in, range->valid_in, range->lba_out, range->valid_out);
+    fprintf(out, "level %d\n", opt_level);
+#define CD_COUNTER_WRITE(name) fprintf(out, #name " %u\n", name);
+    CD_COUNTERS(CD_COUNTER_WRITE)
+#undef CD_COUNTER_WRITE
+    if(ferror(out) || fclose(out) != 0)
+    {
+        out = NULL;
+        goto error;
+    }
+    return 0;
+
+error:
+    printfileerror(out, filename);
+    if(out) { fclose(out); }
+    return 1;
+}
+
+//
+// Add the counters of a partial result file to the current ones
+// Returns nonzero on error
+//
+static int8_t read_partial(const char *filename, char *image, size_t imagesize, cd_range *range, int *level)
+{
+    FILE  *in;
+    char   line[1024];
+    char   key[32];
+    int8_t have_range = 0;
+
+    in = fopen(filename, "r");
+    if(!in)
+    {
+        printfileerror(in, filename);
+        return 1;
+    }
+    if(!fgets(line, sizeof(line), in) || strcmp(line, "edccchk partial 1\n") != 0) { goto invalid; }
+    // Partials written before addresses were saved can't be checked where they meet
+    range->valid_in = range->valid_out = 0;
+    while(fgets(line, sizeof(line), in))
+    {
+        unsigned long value;
+        line[strcspn(line, "\r\n")] = 0;
+        if(!strncmp(line, "image ", 6))
+        {
+            snprintf(image, imagesize, "%s", line + 6);
+            continue;
+        }
+        if(!strncmp(line, "address ", 8))
+        {
+            int valid_in;
+            int valid_out;
+            if(sscanf(line + 8, "%d %d %d %d", &range->lba_in, &valid_in, &range->lba_out, &valid_out) != 4)
+            { goto invalid; }
+            range->valid_in  = valid_in != 0;
+            range->valid_out = valid_out != 0;
+            continue;
+        }
+        if(!strncmp(line, "range ", 6))
+        {
+            if(sscanf(line + 6, "%u %u %u %u", &range->first, &range->end, &range->filesectors, &range->imagesectors) !=
+               4)
+            { goto invalid; }
+            have_range = 1;
+            continue;
+        }
+        if(sscanf(line, "%31s %lu", key, &value) != 2) { goto invalid; }
+        if(!strcmp(key, "level"))
+        {
+            *level = (int)value;
+            continue;
+        }
+#define CD_COUNTER_READ(name)                                                                                        \
+    if(!strcmp(key, #name)) { name += (uint32_t)value; }
+        CD_COUNTERS(CD_COUNTER_READ)
+#undef CD_COUNTER_READ
+    }
+    if(ferror(in) || !have_range) { goto invalid; }
+    fclose(in);
+    return 0;
+
+invalid:
+    printf("Error: %s: Not an edccchk partial result\n", filename);
+    fclose(in);
+    return 1;
+}
+
+static int compare_ranges(const void *a, const void *b)
+{
+    const cd_range *ra = a;
+    const cd_range *rb = b;
+    return ra->first < rb->first ? -1 : ra->first > rb->first;
+}
+
+//
+// Print the report for the current counters and add its CSV row
+//
+static void print_report(const char *infilename, uint32_t imagesectors)
+{
+    double error_rate;
+    double error_rate_low;
+    double error_rate_high;
+
+    sample_estimate(totalerrors, totalsectors, imagesectors, &error_rate, &error_rate_low, &error_rate_high);
+
+    //
+    // Show report
+    //
+	printf("\n-------------------Report:--------------------\n");
+    printf("Non-data sectors........ %d\n", nondatasectors);
+    printf("Mode 0 sectors.......... %d\n", mode0sectors);
+    printf("\twith errors........... %d\n", mode0errors);
+    printf("Mode 1 sectors.......... %d\n", mode1sectors);
+	printf("\twith ECC P errors..... %d\n", mode1_ecc_p_err);
+	printf("\twith ECC Q errors..... %d\n", mode1_ecc_q_err);
+	printf("\twith EDC errors....... %d\n", mode1_edc_err);	
+    printf("\twith errors........... %d\n", mode1errors);
+    printf("Mode 2 form 1 sectors... %d\n", mode2f1sectors);
+	printf("\twith ECC P errors..... %d\n", mode2f1_ecc_p_err);
+	printf("\twith ECC Q errors..... %d\n", mode2f1_ecc_q_err);
+	printf("\twith EDC errors....... %d\n", mode2f1_edc_err);	
+    printf("\twith errors........... %d\n", mode2f1errors);
+    printf("\twith warnings......... %d\n", mode2f1warnings);
+    printf("Mode 2 form 2 sectors... %d\n", mode2f2sectors);
+	printf("\twith EDC errors....... %d\n", mode2f2_edc_err);	
+    printf("\twith errors........... %d\n", mode2f2errors);
+    printf("\twith warnings......... %d\n", mode2f2warnings);
+    printf("Filled sectors.......... %d\n", filledsectors);
+    printf("Total sectors........... %d\n", totalsectors);
+    printf("Total errors............ %d\n", totalerrors);
+	printf("\twith ECC P errors..... %d\n", total_ecc_p_err);	
+    printf("\twith ECC Q errors..... %d\n", total_ecc_q_err);
+    printf("\twith EDC errors....... %d\n", total_edc_err);
+    if(opt_level >= LEVEL_PARANOID)
+    {
+        printf("Address warnings........ %d\n", addresswarnings);
+        printf("Subheader warnings...... %d\n", subheaderwarnings);
+    }
+    printf("Total warnings.......... %d\n", totalwarnings);
+    printf("Total errors+warnings... %d\n", totalerrors + totalwarnings);
+    if(totalsectors < imagesectors)
+    {
+        printf("Sampled sectors......... %u of %u\n", totalsectors, imagesectors);
+        printf("Estimated error rate.... %.4f%% (95%% CI %.4f%% - %.4f%%)\n",
+               error_rate * 100,
+               error_rate_low * 100,
+               error_rate_high * 100);
+        printf("Estimated bad sectors... %.0f (%.0f - %.0f)\n",
+               error_rate * imagesectors,
+               error_rate_low * imagesectors,
+               error_rate_high * imagesectors);
+    }
+	printf("----------------------------------------------\n");
+	
+    write_csv_row(infilename, nondatasectors, mode0sectors, mode0errors,
+                  mode1sectors, mode1errors,
+                  mode2f1sectors, mode2f1errors, mode2f1warnings,
+                  mode2f2sectors, mode2f2errors, mode2f2warnings,
+                  filledsectors, totalsectors,
+                  totalerrors, totalwarnings,
+				  mode1_ecc_p_err, mode1_ecc_q_err, mode1_edc_err,
+				  mode2f1_ecc_p_err, mode2f1_ecc_q_err, mode2f1_edc_err,
+				  mode2f2_edc_err,
+				  total_ecc_p_err, total_ecc_q_err, total_edc_err,
+				  totalsectors < imagesectors, imagesectors,
+				  error_rate, error_rate_low, error_rate_high);
+}
+
+//
+// Merge partial result files into the report of the whole image
+// Returns nonzero on error
+//
+static int8_t merge_partials(int count, char **filenames)
+{
+    cd_range *ranges;
+    char      image[1024];
+    char      other[1024];
+    int       level;
+    uint32_t  imagesectors = 0;
+    uint32_t  covered      = 0;
+    int       i;
+    int8_t    returncode = 1;
+
+    ranges = malloc(count * sizeof(cd_range));
+    if(!ranges)
+    {
+        printf("Out of memory\n");
+        return 1;
+    }
+
+    cd_counters_reset();
+    for(i = 0; i < count; i++)
+    {
+        level = LEVEL_FULL;
+        if(read_partial(filenames[i], i ? other : image, sizeof(image), &ranges[i], &level)) { goto done; }
+        if(!i) { opt_level = level; }
+        else if(ranges[i].filesectors != ranges[0].filesectors || level != opt_level)
+        {
+            printf("Error: %s: Not from the same image and check level as %s\n", filenames[i], filenames[0]);
+            goto done;
+        }
+        else if(strcmp(other, image) != 0) { printf("Warning: %s: Merging %s as %s\n", filenames[i], other, image); }
+        imagesectors += ranges[i].imagesectors;
+    }
+
+    qsort(ranges, count, sizeof(cd_range), compare_ranges);
+    for(i = 0; i < count; i++)
+    {
+        if(i && ranges[i].first < ranges[i - 1].end)
+        {
+            printf("Error: Partial results overlap at sector %u\n", ranges[i].first);
+            goto done;
+        }
+        // The check of the first sector of a part against the sector before, as a whole run does it
+        if(i && opt_level >= LEVEL_PARANOID && ranges[i].first == ranges[i - 1].end && ranges[i - 1].valid_out &&
+           ranges[i].valid_in && ranges[i].lba_in != ranges[i - 1].lba_out + 1)
+        {
+            addresswarnings++;
+            totalwarnings++;
+            printf("Address discontinuity in sector %u, where two partial results meet\n", ranges[i].first);
+        }
+        covered += ranges[i].end - ranges[i].first;
+    }
+
+    printf("Merging %d partial results for %s...\n", count, image);
+    if(covered < ranges[0].filesectors)
+    { printf("Warning: Partial results cover %u of %u sectors\n", covered, ranges[0].filesectors); }
+    print_report(image, imagesectors);
+    printf("Done\n");
+    returncode = 0;
+
+done:
+    free(ranges);
+    return returncode;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Result cache
+//
+// With --cache, the counters of every full check of an image are saved in
+// the cache directory, in the partial result format, under a name made of
+// the check level and the image's device, inode, size and modification
+// time, taken before the image is read; a result is not saved if the name
+// changed during the check.  An image whose name is found there hasn't
+// changed since and is reported from the cache instead of being read.  The
+// modification time of the cache entry is the time of the check; entries
+// older than --revalidate-older-than are checked again to catch bit rot.
+//
+//
+// Nonzero when the whole image is read, so its results describe the image
+//
+static int8_t whole_image(void)
+{
+    return !opt_start_lba && !opt_end_lba && !opt_shard_count && !opt_sample_percent && !opt_sample_sectors &&
+           !opt_skip_map;
+}
+
+static int8_t cache_applicable(void)
+{
+    return opt_cache && whole_image() && !opt_repair;
+}
+
+static int64_t cache_mtime_ns(const struct stat *st)
+{
+#if defined(__APPLE__)
+    return (int64_t)st->st_mtimespec.tv_sec * 1000000000 + st->st_mtimespec.tv_nsec;
+#elif defined(_POSIX_VERSION) && !defined(_WIN32)
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#else
+    return (int64_t)st->st_mtime * 1000000000;
+#endif
+}
+
+//
+// Name of the cache entry for the open image in
+// Returns nonzero if in can't be identified
+//
+static int8_t cache_entry_name(FILE *in, char *name, size_t namesize)
+{
+    struct stat st;
+    if(fstat(fileno(in), &st) != 0) { return 1; }
+    snprintf(name,
+             namesize,
+             "%s/%d-%llx-%llx-%llx-%llx",
+             opt_cache,
+             opt_level,
+             (unsigned long long)st.st_dev,
+             (unsigned long long)st.st_ino,
+             (unsigned long long)st.st_size,
+             (unsigned long long)cache_mtime_ns(&st));
+    return 0;
+}
+
+//
+// Load the cached counters of the cache entry name
+// Returns nonzero if they must be checked instead
+//
+static int8_t cache_lookup(const char *name, cd_range *range)
+{
+    char        image[1024];
+    struct stat st;
+    int         level = LEVEL_FULL;
+    double      age;
+
+    if(stat(name, &st) != 0) { return 1; }
+    age = difftime(time(NULL), st.st_mtime);
+    if(opt_revalidate_age > 0 && age >= opt_revalidate_age)
+    {
+        printf("Cached result is %.1f days old, checking again\n", age / 86400);
+        return 1;
+    }
+    if(read_partial(name, image, sizeof(image), range, &level) || level != opt_level)
+    {
+        cd_counters_reset();
+        return 1;
+    }
+    printf("Unchanged, using cached result from %.1f days ago\n", age / 86400);
+    return 0;
+}
+
+//
+// Save the counters of a full check of the open image in under the cache
+// entry name it had before the check, unless it changed meanwhile
+//
+//
+// Name of a temporary file to write path through, unique to this process and
+// thread, since the threads of a batch or the server can save the same file
+//
+static void temp_path(const char *path, char *temp, size_t size)
+{
+#if defined(__linux__) && defined(SYS_gettid)
+    snprintf(temp, size, "%s.%ld.%ld.tmp", path, (long)getpid(), (long)syscall(SYS_gettid));
+#elif defined(HAVE_PTHREADS)
+    snprintf(temp, size, "%s.%ld.%lx.tmp", path, (long)getpid(), (unsigned long)(uintptr_t)pthread_self());
+#elif defined(_POSIX_VERSION)
+    snprintf(temp, size, "%s.%ld.tmp", path, (long)getpid());
+#else
+    snprintf(temp, size, "%s.tmp", path);
+#endif
+}
+
+static void cache_store(FILE *in, const char *name, const char *infilename, const cd_range *range)
+{
+    char now[4096];
+    char temp[4096 + 48];
+
+    if(cache_entry_name(in, now, sizeof(now)) || strcmp(now, name) != 0)
+    {
+        printf("Image changed while being checked, result not cached\n");
+        return;
+    }
+
+    // Written aside and renamed so that a concurrent lookup never sees half an entry
+    temp_path(name, temp, sizeof(temp));
+    if(write_partial(temp, infilename, range)) { return; }
+#if defined(_WIN32)
+    remove(name);
+#endif
+    if(rename(temp, name) != 0)
+    {
+        printfileerror(NULL, name);
+        remove(temp);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Chunk index
+//
+// With --index, a check saves an index next to the image (image.edccidx)
+// with a fast hash of every chunk of INDEX_CHUNK_SECTORS sectors and the
+// counters the chunk added.  The next check hashes each chunk first and
+// only checks the chunks whose hash changed, adding the saved counters of
+// the others, so an image of which a few megabytes were rewritten is
+// checked in about the time it takes to read it.
+//
+// Paranoid address checks depend on the sector before a chunk, so each
+// chunk also records the address state it started and ended with, and is
+// only reused when it starts with the same state again.
+//
+#define INDEX_CHUNK_SECTORS 1024
+#define INDEX_CHUNK_BYTES   (INDEX_CHUNK_SECTORS * 2352)
+
+typedef struct
+{
+    uint64_t hash;
+    int32_t  lba_in;
+    int32_t  lba_out;
+    int8_t   valid_in;
+    int8_t   valid_out;
+    uint32_t counters[CD_COUNTER_COUNT];
+} index_chunk;
+
+typedef struct
+{
+    index_chunk *old;
+    size_t       oldcount;
+    index_chunk *chunks;
+    size_t       count;
+    size_t       alloc;
+    uint32_t     reused;
+} chunk_index;
+
+#define HASH_PRIME1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+
+static uint64_t hash_round(uint64_t acc, uint64_t word)
+{
+    acc += word * HASH_PRIME2;
+    acc = (acc << 31) | (acc >> 33);
+    return acc * HASH_PRIME1;
+}
+
+//
+// 64-bit hash with four independent lanes, in the manner of xxHash64
+// (sizes are whole sectors, so a multiple of 16 bytes)
+//
+static uint64_t chunk_hash(const uint8_t *src, size_t size)
+{
+    uint64_t lane[4] = {HASH_PRIME1 + HASH_PRIME2, HASH_PRIME2, 0, 0 - HASH_PRIME1};
+    uint64_t word;
+    uint64_t h;
+    size_t   i;
+
+    for(i = 0; i + 32 <= size; i += 32)
+    {
+        memcpy(&word, src + i, 8);
+        lane[0] = hash_round(lane[0], word);
+        memcpy(&word, src + i + 8, 8);
+        lane[1] = hash_round(lane[1], word);
+        memcpy(&word, src + i + 16, 8);
+        lane[2] = hash_round(lane[2], word);
+        memcpy(&word, src + i + 24, 8);
+        lane[3] = hash_round(lane[3], word);
+    }
+    for(; i + 8 <= size; i += 8)
+    {
+        memcpy(&word, src + i, 8);
+        lane[0] = hash_round(lane[0], word);
+    }
+    h = ((lane[0] << 1) | (lane[0] >> 63)) + ((lane[1] << 7) | (lane[1] >> 57)) +
+        ((lane[2] << 12) | (lane[2] >> 52)) + ((lane[3] << 18) | (lane[3] >> 46)) + size;
+    h ^= h >> 33;
+    h *= HASH_PRIME2;
+    h ^= h >> 29;
+    h *= HASH_PRIME1;
+    return h ^ (h >> 32);
+}
+
+//
+// The hash of a whole image chains the hashes of its chunks and its size
+//
+#define IMAGE_HASH_SEED HASH_PRIME2
+
+static uint64_t image_hash_add(uint64_t hash, const uint8_t *chunk, size_t size)
+{
+    return hash_round(hash, chunk_hash(chunk, size));
+}
+
+static uint64_t image_hash_end(uint64_t hash, off_t length)
+{
+    return hash_round(hash, (uint64_t)length);
+}
+
+static void index_path(const char *infilename, char *path, size_t pathsize)
+{
+    snprintf(path, pathsize, "%s.edccidx", infilename);
+}
+
+//
+// Load the index of the image, if there is one for the current level
+//
+// The counters line of an index, naming the counters of each chunk in order
+static const char index_counters[] = "counters"
+#define CD_COUNTER_NAME(name) " " #name
+    CD_COUNTERS(CD_COUNTER_NAME)
+#undef CD_COUNTER_NAME
+    "\n";
+
+static void index_load(chunk_index *index, const char *infilename)
+{
+    char   path[4096];
+    char     line[1024];
+    FILE    *in;
+    int      level        = -1;
+    unsigned chunksectors = 0;
+    int8_t   counters     = 0;
+    size_t   c;
+
+    memset(index, 0, sizeof(*index));
+    index_path(infilename, path, sizeof(path));
+    in = fopen(path, "r");
+    if(!in) { return; }
+    if(!fgets(line, sizeof(line), in) || strcmp(line, "edccchk index 1\n") != 0) { goto invalid; }
+    while(fgets(line, sizeof(line), in))
+    {
+        index_chunk chunk;
+        char       *p = line;
+        size_t      number;
+
+        if(sscanf(line, "level %d", &level) == 1) { continue; }
+        if(sscanf(line, "chunksectors %u", &chunksectors) == 1) { continue; }
+        // Counters saved by a build with other counters can't be added up
+        if(!strncmp(line, "counters", 8))
+        {
+            counters = !strcmp(line, index_counters);
+            continue;
+        }
+        if(strncmp(line, "chunk ", 6) != 0) { continue; }
+        if(level != opt_level || chunksectors != INDEX_CHUNK_SECTORS || !counters) { goto invalid; }
+
+        number          = strtoul(p + 6, &p, 10);
+        chunk.hash      = strtoull(p, &p, 16);
+        chunk.valid_in  = (int8_t)strtol(p, &p, 10);
+        chunk.lba_in    = (int32_t)strtol(p, &p, 10);
+        chunk.valid_out = (int8_t)strtol(p, &p, 10);
+        chunk.lba_out   = (int32_t)strtol(p, &p, 10);
+        for(c = 0; c < CD_COUNTER_COUNT; c++) { chunk.counters[c] = (uint32_t)strtoul(p, &p, 10); }
+        if(number != index->oldcount || *p != '\n') { goto invalid; }
+
+        if(index->oldcount % 256 == 0)
+        {
+            index_chunk *grown = realloc(index->old, (index->oldcount + 256) * sizeof(index_chunk));
+            if(!grown) { goto invalid; }
+            index->old = grown;
+        }
+        index->old[index->oldcount++] = chunk;
+    }
+    fclose(in);
+    return;
+
+invalid:
+    fclose(in);
+    free(index->old);
+    index->old      = NULL;
+    index->oldcount = 0;
+}
+
+//
+// Record a chunk with the given hash; returns NULL when out of memory
+//
+static index_chunk *index_begin_chunk(chunk_index *index, uint64_t hash)
+{
+    index_chunk *chunk;
+    if(index->count == index->alloc)
+    {
+        size_t       alloc = index->alloc ? index->alloc * 2 : 256;
+        index_chunk *grown = realloc(index->chunks, alloc * sizeof(index_chunk));
+        if(!grown) { return NULL; }
+        index->chunks = grown;
+        index->alloc  = alloc;
+    }
+    chunk            = &index->chunks[index->count++];
+    chunk->hash      = hash;
+    chunk->lba_in    = previous_lba;
+    chunk->valid_in  = previous_lba_valid;
+    cd_counters_get(chunk->counters);
+    return chunk;
+}
+
+//
+// Add the saved counters of the chunk if it is unchanged
+// Returns nonzero if it was
+//
+static int8_t index_reuse_chunk(chunk_index *index, index_chunk *chunk)
+{
+    size_t       n   = chunk - index->chunks;
+    index_chunk *old = n < index->oldcount ? &index->old[n] : NULL;
+    if(!old || old->hash != chunk->hash || old->valid_in != chunk->valid_in ||
+       (old->valid_in && old->lba_in != chunk->lba_in))
+    { return 0; }
+    memcpy(chunk->counters, old->counters, sizeof(chunk->counters));
+    chunk->lba_out     = old->lba_out;
+    chunk->valid_out   = old->valid_out;
+    cd_counters_add(old->counters);
+    previous_lba       = old->lba_out;
+    previous_lba_valid = old->valid_out;
+    index->reused++;
+    return 1;
+}
+
+//
+// Turn the counters at the start of a checked chunk into what it added
+//
+static void index_end_chunk(index_chunk *chunk)
+{
+    uint32_t now[CD_COUNTER_COUNT];
+    size_t   c;
+    cd_counters_get(now);
+    for(c = 0; c < CD_COUNTER_COUNT; c++) { chunk->counters[c] = now[c] - chunk->counters[c]; }
+    chunk->lba_out   = previous_lba;
+    chunk->valid_out = previous_lba_valid;
+}
+
+static void index_save(const chunk_index *index, const char *infilename)
+{
+    char   path[4096];
+    char   temp[4096 + 48];
+    FILE  *out;
+    size_t n;
+    size_t c;
+
+    index_path(infilename, path, sizeof(path));
+    temp_path(path, temp, sizeof(temp));
+    out = fopen(temp, "w");
+    if(!out) { goto error; }
+    fprintf(out, "edccchk index 1\n");
+    fprintf(out, "level %d\n", opt_level);
+    fprintf(out, "chunksectors %u\n", INDEX_CHUNK_SECTORS);
+    fputs(index_counters, out);
+    for(n = 0; n < index->count; n++)
+    {
+        const index_chunk *chunk = &index->chunks[n];
+        fprintf(out,
+                "chunk %u %016llx %d %d %d %d",
+                (unsigned)n,
+                (unsigned long long)chunk->hash,
+                chunk->valid_in,
+                chunk->lba_in,
+                chunk->valid_out,
+                chunk->lba_out);
+        for(c = 0; c < CD_COUNTER_COUNT; c++) { fprintf(out, " %u", chunk->counters[c]); }
+        fprintf(out, "\n");
+    }
+    c = ferror(out);
+    if(fclose(out) != 0 || c)
+    {
+        out = NULL;
+        goto error;
+    }
+    out = NULL;
+#if defined(_WIN32)
+    remove(path);
+#endif
+    if(rename(temp, path) == 0) { return; }
+
+error:
+    printfileerror(out, temp);
+    if(out) { fclose(out); }
+    remove(temp);
+}
+
+static void index_free(chunk_index *index)
+{
+    free(index->old);
+    free(index->chunks);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Sparse files
+//
+// Holes of a sparse image read as zeros, and an all-zero sector is a
+// non-data sector, so the whole sectors inside holes are counted as such
+// without being read.  Holes are found with lseek(SEEK_HOLE/SEEK_DATA)
+// where the system has it.
+//
+typedef struct
+{
+    int   fd;
+    off_t start;
+    off_t end;
+} hole_map;
+
+//
+// Find the next run of whole sectors in a hole at or after pos, as
+// [start, end); start == end == length when there is none.  Nothing is
+// looked up while pos is before the end of the last run found.
+//
+static void hole_find(hole_map *holes, off_t pos, off_t length)
+{
+#if defined(SEEK_HOLE) && defined(SEEK_DATA)
+    off_t saved;
+
+    if(pos < holes->end) { return; }
+    // Restore the offset, the stdio stream on the same descriptor relies on it
+    saved = lseek(holes->fd, 0, SEEK_CUR);
+    while(pos < length)
+    {
+        off_t start = lseek(holes->fd, pos, SEEK_HOLE);
+        off_t end;
+        if(start < 0 || start >= length) { break; }
+        end = lseek(holes->fd, start, SEEK_DATA);
+        if(end < 0 || end > length) { end = length; }
+        holes->start = (start + 2351) / 2352 * 2352;
+        holes->end   = end / 2352 * 2352;
+        if(holes->start < holes->end)
+        {
+            lseek(holes->fd, saved, SEEK_SET);
+            return;
+        }
+        pos = end;
+    }
+    lseek(holes->fd, saved, SEEK_SET);
+#else
+    if(pos < holes->end) { return; }
+#endif
+    holes->start = holes->end = length;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Page cache hints
+//
+// A sequential check tells the kernel to read --readahead bytes ahead of
+// what has been read so far, which keeps NFS and rotational disks
+// streaming, and that the pages already read won't be needed again, so
+// the check doesn't push everything else out of the page cache.  Hints
+// are given a window at a time rather than on every read.  Sampled checks
+// read single sectors all over the image and turn readahead off instead.
+//
+typedef struct
+{
+    int   fd;
+    off_t advised;
+    off_t dropped;
+    off_t end;
+} readahead_state;
+
+static void readahead_begin(readahead_state *ra, FILE *in, off_t start, off_t end, int8_t sequential)
+{
+    ra->fd      = fileno(in);
+    ra->advised = start;
+    ra->dropped = start;
+    ra->end     = end;
+#if defined(POSIX_FADV_SEQUENTIAL)
+    if(opt_readahead) { posix_fadvise(ra->fd, start, end - start, sequential ? POSIX_FADV_SEQUENTIAL : POSIX_FADV_RANDOM); }
+#else
+    (void)sequential;
+#endif
+}
+
+//
+// Everything before pos has been read
+//
+static void readahead_advance(readahead_state *ra, off_t pos)
+{
+#if defined(POSIX_FADV_WILLNEED)
+    if(!opt_readahead) { return; }
+    if(ra->advised - pos < opt_readahead / 2 && ra->advised < ra->end)
+    {
+        off_t until = pos + opt_readahead < ra->end ? pos + opt_readahead : ra->end;
+        if(until > ra->advised)
+        {
+            posix_fadvise(ra->fd, ra->advised, until - ra->advised, POSIX_FADV_WILLNEED);
+            ra->advised = until;
+        }
+    }
+    if(pos - ra->dropped >= opt_readahead || (pos >= ra->end && pos > ra->dropped))
+    {
+        posix_fadvise(ra->fd, ra->dropped, pos - ra->dropped, POSIX_FADV_DONTNEED);
+        ra->dropped = pos;
+    }
+#else
+    (void)ra;
+    (void)pos;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Streaming
+//
+// "edccchk -" checks an image piped to standard input, and a FIFO is read
+// the same way, so a dump can be checked while it is being ripped.  The
+// length is unknown until the stream ends, so only whole images can be
+// checked this way, and sectors are checked as soon as they arrive rather
+// than a queue at a time.  The queue doesn't grow: while it is full
+// nothing is read, the pipe fills up and the ripper waits.
+//
+// With --events-fd N, every sector event is written to descriptor N as
+// soon as the sector is checked, one tab separated line each:
+//
+//     image  sector  LBA  MM:SS:FF  event
+//
+// where sector counts from the start of the image and event is e.g.
+// "Failed EDC".  Lines are written whole and unbuffered; a reader that
+// falls behind makes the check wait for it, and one that exits only stops
+// the events, as SIGPIPE is ignored while --events-fd is set.
+//
+#define STREAM_LENGTH ((off_t)UINT32_MAX * 2352)
+
+typedef struct
+{
+    int             fd;
+    const char     *name;
+    const cd_range *range;
+} stream_events;
+
+static void stream_event(void *ctx, const uint8_t *sector, const char *text)
+{
+    stream_events *events = ctx;
+    char           line[4096 + 512];
+    size_t         done = 0;
+    int            n    = snprintf(line,
+                         sizeof(line),
+                         "%s\t%u\t%d\t%02X:%02X:%02X\t%s\n",
+                         events->name,
+                         events->range->first + totalsectors,
+                         sector_lba(sector),
+                         sector[0x00C],
+                         sector[0x00D],
+                         sector[0x00E],
+                         text);
+    if(n < 0) { return; }
+    if((size_t)n >= sizeof(line)) { n = sizeof(line) - 1; }
+    if(events->fd < 0) { return; }
+    while(done < (size_t)n)
+    {
+        ssize_t written = write(events->fd, line + done, (size_t)n - done);
+        if(written < 0 && errno == EINTR) { continue; }
+        if(written < 0 && errno == EPIPE)
+        {
+            // The check goes on without its reader
+            fprintf(stderr, "The reader of the events descriptor is gone, no more events are sent\n");
+            events->fd = -1;
+            return;
+        }
+        if(written <= 0) { return; }
+        done += (size_t)written;
+    }
+}
+
+//
+// Read at least min and at most max bytes, less only at the end of the
+// stream; returns the number read or -1 on error
+//
+static off_t stream_read(FILE *in, uint8_t *buffer, size_t min, size_t max)
+{
+#if defined(_POSIX_VERSION)
+    size_t done = 0;
+    while(done < min)
+    {
+        ssize_t n = read(fileno(in), buffer + done, max - done);
+        if(n < 0 && errno == EINTR) { continue; }
+        if(n < 0) { return -1; }
+        if(!n) { break; }
+        done += (size_t)n;
+    }
+    return (off_t)done;
+#else
+    size_t done = fread(buffer, 1, min, in);
+    (void)max;
+    return ferror(in) ? -1 : (off_t)done;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// GNU ddrescue mapfiles
+//
+// --ddrescue-map writes a mapfile with the sectors that failed their check
+// as bad ("-") regions, the sectors that passed as finished ("+") and all
+// else (sectors outside the range checked, in holes, skipped or after the
+// last whole sector) as non-tried ("?"), so giving it to ddrescue for the
+// next pass re-reads only what didn't verify.
+//
+// --skip-map reads the mapfile of the dump and skips the sectors that
+// overlap any region ddrescue didn't finish; their contents are whatever
+// ddrescue filled the gaps with, so checking them says nothing.
+//
+typedef struct
+{
+    uint32_t first;
+    uint32_t count;
+    char     status;
+} map_run;
+
+typedef struct
+{
+    map_run *runs;
+    size_t   count;
+    size_t   size;
+} rescue_map;
+
+typedef struct
+{
+    off_t start;
+    off_t end;
+} map_region;
+
+typedef struct
+{
+    map_region *regions;
+    size_t      count;
+    size_t      size;
+    size_t      next;
+} skip_map;
+
+//
+// Record the status of the next sector checked; sectors come in order
+// Returns nonzero on error
+//
+static int8_t rescue_map_mark(rescue_map *map, uint32_t sector, char status)
+{
+    map_run *last = map->count ? &map->runs[map->count - 1] : NULL;
+    if(last && last->status == status && last->first + last->count == sector)
+    {
+        last->count++;
+        return 0;
+    }
+    if(map->count == map->size)
+    {
+        size_t   size = map->size ? map->size * 2 : 256;
+        map_run *runs = realloc(map->runs, size * sizeof(map_run));
+        if(!runs) { return 1; }
+        map->runs = runs;
+        map->size = size;
+    }
+    map->runs[map->count].first  = sector;
+    map->runs[map->count].count  = 1;
+    map->runs[map->count].status = status;
+    map->count++;
+    return 0;
+}
+
+static void rescue_map_line(FILE *out, off_t pos, off_t end, char status)
+{
+    if(end > pos) { fprintf(out, "0x%08llX  0x%08llX  %c\n", (long long)pos, (long long)(end - pos), status); }
+}
+
+//
+// Write the mapfile of an image of length bytes
+// Returns nonzero on error
+//
+static int8_t rescue_map_save(const rescue_map *map, const char *filename, const char *infilename, off_t length)
+{
+    FILE  *out;
+    off_t  pos = 0;
+    size_t i;
+
+    out = fopen(filename, "w");
+    if(!out) { goto error; }
+    fprintf(out, "# Mapfile. Created by edccchk from %s\n", infilename);
+    fprintf(out, "# current_pos  current_status  current_pass\n");
+    fprintf(out, "0x%08llX     +               1\n", (long long)0);
+    fprintf(out, "#      pos        size  status\n");
+    for(i = 0; i < map->count; i++)
+    {
+        off_t start = (off_t)map->runs[i].first * 2352;
+        off_t end   = start + (off_t)map->runs[i].count * 2352;
+        if(end > length) { end = length; }
+        rescue_map_line(out, pos, start, '?');
+        rescue_map_line(out, start, end, map->runs[i].status);
+        pos = end;
+    }
+    rescue_map_line(out, pos, length, '?');
+    if(ferror(out) || fclose(out) != 0)
+    {
+        out = NULL;
+        goto error;
+    }
+    return 0;
+
+error:
+    printfileerror(out, filename);
+    if(out) { fclose(out); }
+    return 1;
+}
+
+//
+// Load the regions a mapfile doesn't mark as finished
+// Returns nonzero on error
+//
+static int8_t skip_map_load(skip_map *map, const char *filename)
+{
+    FILE  *in;
+    char   line[1024];
+    int8_t status_line = 1;
+
+    in = fopen(filename, "r");
+    if(!in)
+    {
+        printfileerror(in, filename);
+        return 1;
+    }
+    while(fgets(line, sizeof(line), in))
+    {
+        long long pos;
+        long long size;
+        char      status;
+
+        if(line[strspn(line, " \t\r\n")] == '#' || !line[strspn(line, " \t\r\n")]) { continue; }
+        // The first line is the position and status of ddrescue itself
+        if(status_line)
+        {
+            status_line = 0;
+            continue;
+        }
+        if(sscanf(line, "%lli %lli %c", &pos, &size, &status) != 3 || pos < 0 || size < 0) { goto invalid; }
+        if(status == '+' || !size) { continue; }
+        if(map->count && map->regions[map->count - 1].end == pos)
+        {
+            map->regions[map->count - 1].end = pos + size;
+            continue;
+        }
+        if(map->count && map->regions[map->count - 1].end > pos) { goto invalid; }
+        if(map->count == map->size)
+        {
+            size_t      grown   = map->size ? map->size * 2 : 16;
+            map_region *regions = realloc(map->regions, grown * sizeof(map_region));
+            if(!regions)
+            {
+                printf("Out of memory\n");
+                fclose(in);
+                return 1;
+            }
+            map->regions = regions;
+            map->size    = grown;
+        }
+        map->regions[map->count].start = pos;
+        map->regions[map->count].end   = pos + size;
+        map->count++;
+    }
+    if(ferror(in) || status_line) { goto invalid; }
+    fclose(in);
+    return 0;
+
+invalid:
+    printf("Error: %s: Not a ddrescue mapfile\n", filename);
+    fclose(in);
+    return 1;
+}
+
+//
+// Whether the sector at pos overlaps a region ddrescue didn't finish;
+// sectors are looked up in order
+//
+static int8_t skip_map_covers(skip_map *map, off_t pos)
+{
+    while(map->next < map->count && map->regions[map->next].end <= pos) { map->next++; }
+    return map->next < map->count && map->regions[map->next].start < pos + 2352;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// ECM output
+//
+// --ecm-out FILE writes the image checked as an ECM v1.0 file, the format
+// of ECM 1.0 and unecm, from the same reads as the check.  The image is
+// cut into chunks of whole sectors, which encoder threads turn into ECM
+// records while a writer thread appends them to FILE in order; the check
+// waits when every chunk buffer is in use.
+//
+// A Mode 1 sector whose EDC, ECC and reserved bytes are right is stored
+// as its address and user data (type 1).  The sync and header of a Mode 2
+// sector are stored as they are, and the rest as its subheader and user
+// data if its subheader copies match and its EDC and ECC (type 2, form 1)
+// or EDC (type 3, form 2) are right.  Everything else, failing sectors
+// included, is stored byte for byte (type 0).  The file ends with an end
+// marker and the EDC of the whole image.
+//
+#define ECM_CHUNK_SECTORS 448
+#define ECM_CHUNK_BYTES (ECM_CHUNK_SECTORS * 2352)
+// Record headers of a chunk take at most this many bytes
+#define ECM_CHUNK_HEADERS (2 * ECM_CHUNK_SECTORS * 5 + 5)
+
+enum
+{
+    ECM_SLOT_FREE,
+    ECM_SLOT_FILLED,
+    ECM_SLOT_ENCODED
+};
+
+typedef struct
+{
+    uint8_t *raw;
+    size_t   rawbytes;
+    uint8_t *out;
+    size_t   outbytes;
+    uint32_t types[4];
+    int8_t   state;
+} ecm_slot;
+
+typedef struct
+{
+    FILE       *out;
+    const char *filename;
+    ecm_slot   *slots;
+    size_t      nslots;
+    uint64_t    nfilled;
+    uint64_t    nencoding;
+    uint64_t    nwritten;
+    uint32_t    edc;
+    off_t       outbytes;
+    uint32_t    types[4];
+    int8_t      error;
+    int8_t      quit;
+#ifdef HAVE_PTHREADS
+    pthread_t      *threads;
+    size_t          nthreads;
+    pthread_t       writer;
+    int8_t          writing;
+    pthread_mutex_t lock;
+    pthread_cond_t  work;
+    pthread_cond_t  space;
+#endif
+} ecm_writer;
+
+//
+// Type of the ECM record for a sector, 0 if it is stored as it is
+//
+static int ecm_sector_type(const uint8_t *sector)
+{
+    const uint8_t *m2sec = sector + 0x10;
+
+    if(!is_sync(sector)) { return 0; }
+    if(sector[0x00F] == 0x01)
+    {
+        return !memcmp(sector + 0x814, zeroreserved, sizeof(zeroreserved)) &&
+                       edc_compute(0, sector, 0x810) == get32lsb(sector + 0x810) &&
+                       ecc_checksector(sector + 0xC, sector + 0x10, sector + 0x81C)
+                   ? 1
+                   : 0;
+    }
+    if(sector[0x00F] != 0x02 || memcmp(m2sec, m2sec + 4, 4) != 0) { return 0; }
+    if(edc_compute(0, m2sec, 0x808) == get32lsb(m2sec + 0x808) && ecc_checksector(zeroaddress, m2sec, m2sec + 0x80C))
+    { return 2; }
+    if(edc_compute(0, m2sec, 0x91C) == get32lsb(m2sec + 0x91C)) { return 3; }
+    return 0;
+}
+
+static uint8_t *ecm_type_count(uint8_t *out, uint32_t type, uint32_t count)
+{
+    count--;
+    *out++ = (uint8_t)(((count >= 32) << 7) | ((count & 31) << 2) | type);
+    for(count >>= 5; count; count >>= 7) { *out++ = (uint8_t)(((count >= 128) << 7) | (count & 127)); }
+    return out;
+}
+
+//
+// Turn the raw bytes of a chunk into ECM records, each run of sectors of
+// one type (or of bytes stored as they are) under one header
+//
+static void ecm_encode(ecm_slot *slot)
+{
+    const uint8_t *raw     = slot->raw;
+    const uint8_t *literal = raw;
+    uint8_t       *out     = slot->out;
+    size_t         sectors = slot->rawbytes / 2352;
+    size_t         i       = 0;
+
+    memset(slot->types, 0, sizeof(slot->types));
+    while(i < sectors)
+    {
+        const uint8_t *sector = raw + i * 2352;
+        int            type   = ecm_sector_type(sector);
+        size_t         run;
+
+        if(!type)
+        {
+            i++;
+            continue;
+        }
+        // Bytes stored as they are, up to the sync and header of a Mode 2 sector
+        if(type != 1) { sector += 0x10; }
+        if(sector > literal)
+        {
+            out = ecm_type_count(out, 0, (uint32_t)(sector - literal));
+            memcpy(out, literal, sector - literal);
+            out += sector - literal;
+            slot->types[0] += (uint32_t)(sector - literal);
+        }
+        // Mode 2 sectors each have their sync and header in between
+        for(run = 1; type == 1 && i + run < sectors && ecm_sector_type(raw + (i + run) * 2352) == 1; run++) { }
+        out = ecm_type_count(out, (uint32_t)type, (uint32_t)run);
+        for(; run; run--, i++)
+        {
+            sector = raw + i * 2352;
+            switch(type)
+            {
+                case 1:
+                    memcpy(out, sector + 0x00C, 0x003);
+                    memcpy(out + 0x003, sector + 0x010, 0x800);
+                    out += 0x803;
+                    break;
+                case 2:
+                    memcpy(out, sector + 0x014, 0x804);
+                    out += 0x804;
+                    break;
+                default:
+                    memcpy(out, sector + 0x014, 0x918);
+                    out += 0x918;
+                    break;
+            }
+            slot->types[type]++;
+        }
+        literal = raw + i * 2352;
+    }
+    if(raw + slot->rawbytes > literal)
+    {
+        out = ecm_type_count(out, 0, (uint32_t)(raw + slot->rawbytes - literal));
+        memcpy(out, literal, raw + slot->rawbytes - literal);
+        out += raw + slot->rawbytes - literal;
+        slot->types[0] += (uint32_t)(raw + slot->rawbytes - literal);
+    }
+    slot->outbytes = (size_t)(out - slot->out);
+}
+
+static void ecm_write_slot(ecm_writer *ecm, ecm_slot *slot)
+{
+    size_t i;
+    ecm->edc = edc_compute(ecm->edc, slot->raw, slot->rawbytes);
+    if(!ecm->error && fwrite(slot->out, 1, slot->outbytes, ecm->out) != slot->outbytes) { ecm->error = 1; }
+    ecm->outbytes += (off_t)slot->outbytes;
+    for(i = 0; i < 4; i++) { ecm->types[i] += slot->types[i]; }
+}
+
+#ifdef HAVE_PTHREADS
+//
+// Encodes filled chunks in turn
+//
+static void *ecm_encoder(void *arg)
+{
+    ecm_writer *ecm = arg;
+    pthread_mutex_lock(&ecm->lock);
+    for(;;)
+    {
+        ecm_slot *slot;
+        while(!(ecm->nencoding < ecm->nfilled) && !ecm->quit) { pthread_cond_wait(&ecm->work, &ecm->lock); }
+        if(!(ecm->nencoding < ecm->nfilled)) { break; }
+        slot = &ecm->slots[ecm->nencoding++ % ecm->nslots];
+        pthread_mutex_unlock(&ecm->lock);
+        ecm_encode(slot);
+        pthread_mutex_lock(&ecm->lock);
+        slot->state = ECM_SLOT_ENCODED;
+        pthread_cond_broadcast(&ecm->work);
+    }
+    pthread_mutex_unlock(&ecm->lock);
+    return NULL;
+}
+
+//
+// Writes the encoded chunks in order
+//
+static void *ecm_writer_thread(void *arg)
+{
+    ecm_writer *ecm = arg;
+    pthread_mutex_lock(&ecm->lock);
+    for(;;)
+    {
+        ecm_slot *slot = &ecm->slots[ecm->nwritten % ecm->nslots];
+        while(!(ecm->nwritten < ecm->nfilled && slot->state == ECM_SLOT_ENCODED) &&
+              !(ecm->quit && ecm->nwritten == ecm->nfilled))
+        { pthread_cond_wait(&ecm->work, &ecm->lock); }
+        if(ecm->nwritten == ecm->nfilled) { break; }
+        pthread_mutex_unlock(&ecm->lock);
+        ecm_write_slot(ecm, slot);
+        pthread_mutex_lock(&ecm->lock);
+        slot->state    = ECM_SLOT_FREE;
+        slot->rawbytes = 0;
+        ecm->nwritten++;
+        pthread_cond_broadcast(&ecm->space);
+    }
+    pthread_mutex_unlock(&ecm->lock);
+    return NULL;
+}
+
+//
+// Let the threads finish the chunks handed to them, and wait for them
+//
+static void ecm_stop(ecm_writer *ecm)
+{
+    size_t i;
+    if(!ecm->writing) { return; }
+    pthread_mutex_lock(&ecm->lock);
+    ecm->quit = 1;
+    pthread_cond_broadcast(&ecm->work);
+    pthread_mutex_unlock(&ecm->lock);
+    for(i = 0; i < ecm->nthreads; i++) { pthread_join(ecm->threads[i], NULL); }
+    pthread_join(ecm->writer, NULL);
+    ecm->writing  = 0;
+    ecm->nthreads = 0;
+}
+#endif
+
+//
+// Hand the chunk being filled to the encoders, or encode and write it
+// right away without threads
+//
+static void ecm_submit(ecm_writer *ecm)
+{
+    ecm_slot *slot = &ecm->slots[ecm->nfilled % ecm->nslots];
+#ifdef HAVE_PTHREADS
+    if(ecm->nthreads)
+    {
+        pthread_mutex_lock(&ecm->lock);
+        slot->state = ECM_SLOT_FILLED;
+        ecm->nfilled++;
+        pthread_cond_broadcast(&ecm->work);
+        pthread_mutex_unlock(&ecm->lock);
+        return;
+    }
+#endif
+    ecm_encode(slot);
+    ecm_write_slot(ecm, slot);
+    slot->rawbytes = 0;
+    ecm->nfilled++;
+}
+
+//
+// Returns nonzero on error
+//
+static int8_t ecm_open(ecm_writer *ecm, const char *filename)
+{
+    static const uint8_t magic[4] = {'E', 'C', 'M', 0x00};
+    size_t               i;
+
+    memset(ecm, 0, sizeof(*ecm));
+    ecm->filename = filename;
+    ecm->nslots   = 2;
+#ifdef HAVE_PTHREADS
+    ecm->nthreads = opt_threads > 1 ? opt_threads - 1 : 1;
+    ecm->nslots   = 2 * ecm->nthreads + 2;
+    pthread_mutex_init(&ecm->lock, NULL);
+    pthread_cond_init(&ecm->work, NULL);
+    pthread_cond_init(&ecm->space, NULL);
+#endif
+    ecm->slots = calloc(ecm->nslots, sizeof(ecm_slot));
+    if(!ecm->slots)
+    {
+        printf("Out of memory\n");
+        return 1;
+    }
+    for(i = 0; i < ecm->nslots; i++)
+    {
+        ecm->slots[i].raw = malloc(ECM_CHUNK_BYTES);
+        ecm->slots[i].out = malloc(ECM_CHUNK_BYTES + ECM_CHUNK_HEADERS);
+        if(!ecm->slots[i].raw || !ecm->slots[i].out)
+        {
+            printf("Out of memory\n");
+            return 1;
+        }
+    }
+
+    ecm->out = fopen(filename, "wb");
+    if(!ecm->out || fwrite(magic, 1, sizeof(magic), ecm->out) != sizeof(magic))
+    {
+        printfileerror(ecm->out, filename);
+        return 1;
+    }
+    ecm->outbytes = sizeof(magic);
+
+#ifdef HAVE_PTHREADS
+    // Without threads the chunks are encoded and written by the check itself
+    ecm->threads = malloc(ecm->nthreads * sizeof(pthread_t));
+    if(!ecm->threads || pthread_create(&ecm->writer, NULL, ecm_writer_thread, ecm) != 0)
+    {
+        ecm->nthreads = 0;
+        return 0;
+    }
+    ecm->writing = 1;
+    for(i = 0; i < ecm->nthreads; i++)
+    {
+        if(pthread_create(&ecm->threads[i], NULL, ecm_encoder, ecm) != 0) { break; }
+    }
+    ecm->nthreads = i;
+    if(!ecm->nthreads) { ecm_stop(ecm); }
+#endif
+    return 0;
+}
+
+//
+// Add the next bytes of the image
+// Returns nonzero on error
+//
+static int8_t ecm_write(ecm_writer *ecm, const uint8_t *data, size_t size)
+{
+    while(size)
+    {
+        ecm_slot *slot = &ecm->slots[ecm->nfilled % ecm->nslots];
+        size_t    n;
+
+        if(ecm->error)
+        {
+            printfileerror(NULL, ecm->filename);
+            return 1;
+        }
+#ifdef HAVE_PTHREADS
+        if(ecm->nthreads)
+        {
+            // Wait for the writer to be done with the chunk before refilling it
+            pthread_mutex_lock(&ecm->lock);
+            while(slot->state != ECM_SLOT_FREE) { pthread_cond_wait(&ecm->space, &ecm->lock); }
+            pthread_mutex_unlock(&ecm->lock);
+        }
+#endif
+        n = ECM_CHUNK_BYTES - slot->rawbytes;
+        if(n > size) { n = size; }
+        memcpy(slot->raw + slot->rawbytes, data, n);
+        slot->rawbytes += n;
+        data += n;
+        size -= n;
+        if(slot->rawbytes == ECM_CHUNK_BYTES) { ecm_submit(ecm); }
+    }
+    return 0;
+}
+
+//
+// Write what is left, the end marker and the EDC, and free everything;
+// write is zero if the file is given up
+// Returns nonzero on error
+//
+static int8_t ecm_close(ecm_writer *ecm, int8_t write)
+{
+    const char *filename = ecm->filename;
+    uint8_t     trailer[9];
+    uint8_t    *end;
+    size_t      i;
+
+    if(!ecm->filename) { return 0; }
+    if(write && ecm->out)
+    {
+        ecm_slot *slot = &ecm->slots[ecm->nfilled % ecm->nslots];
+#ifdef HAVE_PTHREADS
+        if(ecm->nthreads)
+        {
+            pthread_mutex_lock(&ecm->lock);
+            while(slot->state != ECM_SLOT_FREE) { pthread_cond_wait(&ecm->space, &ecm->lock); }
+            pthread_mutex_unlock(&ecm->lock);
+        }
+#endif
+        if(slot->rawbytes) { ecm_submit(ecm); }
+    }
+#ifdef HAVE_PTHREADS
+    ecm_stop(ecm);
+    pthread_cond_destroy(&ecm->space);
+    pthread_cond_destroy(&ecm->work);
+    pthread_mutex_destroy(&ecm->lock);
+    free(ecm->threads);
+#endif
+    for(i = 0; ecm->slots && i < ecm->nslots; i++)
+    {
+        free(ecm->slots[i].raw);
+        free(ecm->slots[i].out);
+    }
+    free(ecm->slots);
+    ecm->filename = NULL;
+    if(!ecm->out) { return 1; }
+
+    if(write && !ecm->error)
+    {
+        end    = ecm_type_count(trailer, 0, 0);
+        end[0] = (uint8_t)(ecm->edc >> 0);
+        end[1] = (uint8_t)(ecm->edc >> 8);
+        end[2] = (uint8_t)(ecm->edc >> 16);
+        end[3] = (uint8_t)(ecm->edc >> 24);
+        end += 4;
+        if(fwrite(trailer, 1, end - trailer, ecm->out) != (size_t)(end - trailer)) { ecm->error = 1; }
+        ecm->outbytes += end - trailer;
+    }
+    if(fclose(ecm->out) != 0) { ecm->error = 1; }
+    ecm->out = NULL;
+    if(!write || ecm->error)
+    {
+        if(write) { printfileerror(NULL, filename); }
+        // Don't leave half an ECM file behind
+        remove(filename);
+        return 1;
+    }
+    printf("Wrote %s: %u Mode 1, %u Mode 2 form 1 and %u Mode 2 form 2 sectors and %u other bytes in %lld bytes\n",
+           filename,
+           ecm->types[1],
+           ecm->types[2],
+           ecm->types[3],
+           ecm->types[0],
+           (long long)ecm->outbytes);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// In-place repair
+//
+// --repair corrects the failing sectors that their P and Q codes can and
+// writes only those sectors back into the image.  First the original
+// bytes of every sector about to be written go to an undo journal next to
+// the image (image.edccundo), which is written aside, flushed to disk and
+// renamed into place; only then are the sectors rewritten and the image
+// flushed.  "edccchk --undo image" writes the original bytes back and
+// removes the journal.  A crash before the rename leaves the image as it
+// was; after it, --undo restores the image whatever was rewritten.
+//
+// The journal holds, little-endian:
+//
+//   "EDCCUNDO", version (4 bytes), sector count (4), image size (8)
+//   for each sector: file offset (8), original 2352 bytes
+//   chunk_hash() of all of the above (8)
+//
+#define UNDO_MAGIC "EDCCUNDO"
+#define UNDO_VERSION 1
+#define UNDO_HEADER_BYTES 24
+#define UNDO_ENTRY_BYTES (8 + 2352)
+
+typedef struct
+{
+    off_t   offset;
+    uint8_t original[2352];
+    uint8_t repaired[2352];
+} repair_entry;
+
+typedef struct
+{
+    repair_entry *entries;
+    size_t        count;
+    size_t        size;
+    uint32_t      failed;
+} repair_list;
+
+static void undo_path(const char *infilename, char *path, size_t pathsize)
+{
+    snprintf(path, pathsize, "%s.edccundo", infilename);
+}
+
+static void put_lsb(uint8_t *dst, uint64_t value, size_t bytes)
+{
+    for(; bytes; bytes--, value >>= 8) { *dst++ = (uint8_t)value; }
+}
+
+//
+// Keep a failing sector if its codes can correct it
+// Returns nonzero on error
+//
+static int8_t repair_add(repair_list *list, const uint8_t *sector, off_t offset)
+{
+    repair_entry *entry;
+
+    if(list->count == list->size)
+    {
+        size_t        size    = list->size ? list->size * 2 : 16;
+        repair_entry *entries = realloc(list->entries, size * sizeof(repair_entry));
+        if(!entries) { return 1; }
+        list->entries = entries;
+        list->size    = size;
+    }
+    entry = &list->entries[list->count];
+    memcpy(entry->original, sector, 2352);
+    memcpy(entry->repaired, sector, 2352);
+    if(!ecc_repair(entry->repaired))
+    {
+        list->failed++;
+        return 0;
+    }
+    entry->offset = offset;
+    list->count++;
+    return 0;
+}
+
+#ifdef HAVE_REPAIR
+//
+// Write a whole buffer at offset
+// Returns nonzero on error
+//
+static int8_t pwrite_all(int fd, const uint8_t *buffer, size_t size, off_t offset)
+{
+    while(size)
+    {
+        ssize_t n = pwrite(fd, buffer, size, offset);
+        if(n < 0 && errno == EINTR) { continue; }
+        if(n <= 0) { return 1; }
+        buffer += n;
+        size -= (size_t)n;
+        offset += n;
+    }
+    return 0;
+}
+
+//
+// Flush the directory holding path, so a rename or removal in it lasts
+// Returns nonzero on error
+//
+static int8_t fsync_dir(const char *path)
+{
+    char        dir[4096 + 16];
+    const char *slash = strrchr(path, '/');
+    int         fd;
+    int         e;
+    int8_t      failed;
+
+    if(!slash) { strcpy(dir, "."); }
+    else if(slash == path) { strcpy(dir, "/"); }
+    else { snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path); }
+    fd = open(dir, O_RDONLY);
+    if(fd < 0) { return 1; }
+    failed = fsync(fd) != 0;
+    e      = errno;
+    close(fd);
+    errno = e;
+    return failed;
+}
+
+//
+// Write the undo journal and the repaired sectors
+// Returns nonzero on error
+//
+static int8_t repair_apply(const repair_list *list, const char *infilename, off_t length)
+{
+    char     path[4096 + 16];
+    char     temp[4096 + 48];
+    size_t   size = UNDO_HEADER_BYTES + list->count * UNDO_ENTRY_BYTES + 8;
+    uint8_t *journal;
+    uint8_t *p;
+    int      fd;
+    size_t   i;
+
+    if(!list->count) { return 0; }
+    undo_path(infilename, path, sizeof(path));
+    if(!access(path, F_OK))
+    {
+        printf("Error: %s exists; undo the last repair with --undo or remove it first\n", path);
+        return 1;
+    }
+
+    journal = malloc(size);
+    if(!journal)
+    {
+        printf("Out of memory\n");
+        return 1;
+    }
+    memcpy(journal, UNDO_MAGIC, 8);
+    put_lsb(journal + 8, UNDO_VERSION, 4);
+    put_lsb(journal + 12, list->count, 4);
+    put_lsb(journal + 16, (uint64_t)length, 8);
+    for(i = 0, p = journal + UNDO_HEADER_BYTES; i < list->count; i++, p += UNDO_ENTRY_BYTES)
+    {
+        put_lsb(p, (uint64_t)list->entries[i].offset, 8);
+        memcpy(p + 8, list->entries[i].original, 2352);
+    }
+    put_lsb(p, chunk_hash(journal, size - 8), 8);
+
+    //
+    // The journal must be on disk before the image is touched
+    //
+    snprintf(temp, sizeof(temp), "%s.%ld.tmp", path, (long)getpid());
+    fd = open(temp, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if(fd < 0 || pwrite_all(fd, journal, size, 0) || fsync(fd) != 0)
+    {
+        printfileerror(NULL, temp);
+        if(fd >= 0)
+        {
+            close(fd);
+            remove(temp);
+        }
+        free(journal);
+        return 1;
+    }
+    close(fd);
+    free(journal);
+    if(rename(temp, path) != 0)
+    {
+        printfileerror(NULL, path);
+        remove(temp);
+        return 1;
+    }
+    if(fsync_dir(path))
+    {
+        printfileerror(NULL, path);
+        return 1;
+    }
+
+    fd = open(infilename, O_WRONLY);
+    if(fd < 0)
+    {
+        printfileerror(NULL, infilename);
+        return 1;
+    }
+    for(i = 0; i < list->count; i++)
+    {
+        if(pwrite_all(fd, list->entries[i].repaired, 2352, list->entries[i].offset))
+        {
+            printfileerror(NULL, infilename);
+            printf("Restore the image with --undo\n");
+            close(fd);
+            return 1;
+        }
+        print_sector_event("Repaired sector", list->entries[i].repaired, "");
+    }
+    if(fsync(fd) != 0 || close(fd) != 0)
+    {
+        printfileerror(NULL, infilename);
+        printf("Restore the image with --undo\n");
+        return 1;
+    }
+    return 0;
+}
+
+//
+// Write back the original bytes of the last repair and remove its journal
+// Returns nonzero on error
+//
+static int8_t undo_run(const char *infilename)
+{
+    char        path[4096 + 16];
+    FILE       *in      = NULL;
+    uint8_t    *journal = NULL;
+    long        size;
+    uint32_t    count;
+    struct stat st;
+    int         fd = -1;
+    size_t      i;
+
+    undo_path(infilename, path, sizeof(path));
+    in = fopen(path, "rb");
+    if(!in || fseek(in, 0, SEEK_END) != 0 || (size = ftell(in)) < 0 || fseek(in, 0, SEEK_SET) != 0)
+    {
+        printfileerror(in, path);
+        goto error;
+    }
+    journal = malloc(size ? (size_t)size : 1);
+    if(!journal)
+    {
+        printf("Out of memory\n");
+        goto error;
+    }
+    if(fread(journal, 1, (size_t)size, in) != (size_t)size)
+    {
+        printfileerror(in, path);
+        goto error;
+    }
+    count = get32lsb(journal + 12);
+    if(size < UNDO_HEADER_BYTES + 8 || memcmp(journal, UNDO_MAGIC, 8) != 0 || get32lsb(journal + 8) != UNDO_VERSION ||
+       (uint64_t)size != UNDO_HEADER_BYTES + (uint64_t)count * UNDO_ENTRY_BYTES + 8 ||
+       get64lsb(journal + size - 8) != chunk_hash(journal, (size_t)size - 8))
+    {
+        printf("Error: %s: Not a complete edccchk undo journal\n", path);
+        goto error;
+    }
+
+    fd = open(infilename, O_WRONLY);
+    if(fd < 0 || fstat(fd, &st) != 0)
+    {
+        printfileerror(NULL, infilename);
+        goto error;
+    }
+    if((uint64_t)st.st_size != get64lsb(journal + 16))
+    {
+        printf("Error: %s: Not the size it was when repaired\n", infilename);
+        goto error;
+    }
+    for(i = 0; i < count; i++)
+    {
+        const uint8_t *entry = journal + UNDO_HEADER_BYTES + i * UNDO_ENTRY_BYTES;
+        if(pwrite_all(fd, entry + 8, 2352, (off_t)get64lsb(entry)))
+        {
+            printfileerror(NULL, infilename);
+            goto error;
+        }
+    }
+    if(fsync(fd) != 0)
+    {
+        printfileerror(NULL, infilename);
+        goto error;
+    }
+    close(fd);
+    fclose(in);
+    free(journal);
+    // Only once the image is safely back
+    if(remove(path) != 0 || fsync_dir(path))
+    {
+        printfileerror(NULL, path);
+        return 1;
+    }
+    printf("Restored %u sectors of %s\n", count, infilename);
+    return 0;
+
+error:
+    if(fd >= 0) { close(fd); }
+    if(in) { fclose(in); }
+    free(journal);
+    return 1;
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// User data extraction
+//
+// --extract-iso FILE writes the 2048 bytes of user data of every sector
+// checked to FILE: those of Mode 1 and Mode 2 form 1 sectors, and zeros
+// for Mode 2 form 2 sectors, whose 2324 bytes don't fit, and for sectors
+// without data, so every sector stays at its place for mounting.
+// --extract-2336 FILE writes every sector without its sync and header, as
+// 2336-byte Mode 2 images have them, form 2 data included.  With
+// --bad-marker TEXT, the data of sectors failing EDC is replaced by TEXT
+// over and over.
+//
+// The data is gathered in large page-aligned buffers, which a writer
+// thread writes out in order while the check goes on; the check waits
+// when all of them are full.
+//
+#define EXTRACT_BUFFERS 4
+#define EXTRACT_BUFFER_SECTORS 2048
+
+typedef struct
+{
+    FILE       *out;
+    const char *filename;
+    size_t      record;
+    uint8_t    *buffers[EXTRACT_BUFFERS];
+    size_t      fill[EXTRACT_BUFFERS];
+    uint64_t    nfilled;
+    uint64_t    nwritten;
+    uint32_t    sectors;
+    uint32_t    marked;
+    int8_t      error;
+    int8_t      quit;
+#ifdef HAVE_PTHREADS
+    pthread_t       writer;
+    int8_t          writing;
+    pthread_mutex_t lock;
+    pthread_cond_t  work;
+    pthread_cond_t  space;
+#endif
+} extract_writer;
+
+static void extract_write_buffer(extract_writer *x, size_t index)
+{
+    if(!x->error && fwrite(x->buffers[index], 1, x->fill[index], x->out) != x->fill[index]) { x->error = 1; }
+}
+
+#ifdef HAVE_PTHREADS
+static void *extract_writer_thread(void *arg)
+{
+    extract_writer *x = arg;
+    pthread_mutex_lock(&x->lock);
+    for(;;)
+    {
+        size_t index;
+        while(x->nwritten == x->nfilled && !x->quit) { pthread_cond_wait(&x->work, &x->lock); }
+        if(x->nwritten == x->nfilled) { break; }
+        index = x->nwritten % EXTRACT_BUFFERS;
+        pthread_mutex_unlock(&x->lock);
+        extract_write_buffer(x, index);
+        pthread_mutex_lock(&x->lock);
+        x->fill[index] = 0;
+        x->nwritten++;
+        pthread_cond_broadcast(&x->space);
+    }
+    pthread_mutex_unlock(&x->lock);
+    return NULL;
+}
+#endif
+
+//
+// Hand the buffer being filled to the writer, or write it right away
+// without threads
+//
+static void extract_submit(extract_writer *x)
+{
+#ifdef HAVE_PTHREADS
+    if(x->writing)
+    {
+        pthread_mutex_lock(&x->lock);
+        x->nfilled++;
+        pthread_cond_broadcast(&x->work);
+        // Wait for the next buffer to be written out
+        while(x->nfilled - x->nwritten >= EXTRACT_BUFFERS) { pthread_cond_wait(&x->space, &x->lock); }
+        pthread_mutex_unlock(&x->lock);
+        return;
+    }
+#endif
+    extract_write_buffer(x, x->nfilled % EXTRACT_BUFFERS);
+    x->fill[x->nfilled % EXTRACT_BUFFERS] = 0;
+    x->nfilled++;
+}
+
+//
+// Returns nonzero on error
+//
+static int8_t extract_open(extract_writer *x, const char *filename, size_t record)
+{
+    size_t i;
+
+    memset(x, 0, sizeof(*x));
+    x->filename = filename;
+    x->record   = record;
+    for(i = 0; i < EXTRACT_BUFFERS; i++)
+    {
+#if defined(_POSIX_VERSION)
+        void *buffer = NULL;
+        if(posix_memalign(&buffer, 4096, EXTRACT_BUFFER_SECTORS * record) != 0) { buffer = NULL; }
+        x->buffers[i] = buffer;
+#else
+        x->buffers[i] = malloc(EXTRACT_BUFFER_SECTORS * record);
+#endif
+        if(!x->buffers[i])
+        {
+            printf("Out of memory\n");
+            return 1;
+        }
+    }
+    x->out = fopen(filename, "wb");
+    if(!x->out)
+    {
+        printfileerror(x->out, filename);
+        return 1;
+    }
+    // Whole buffers are written at once
+    setvbuf(x->out, NULL, _IONBF, 0);
+#ifdef HAVE_PTHREADS
+    pthread_mutex_init(&x->lock, NULL);
+    pthread_cond_init(&x->work, NULL);
+    pthread_cond_init(&x->space, NULL);
+    x->writing = pthread_create(&x->writer, NULL, extract_writer_thread, x) == 0;
+#endif
+    return 0;
+}
+
+//
+// Add the data of the next sector
+// Returns nonzero on error
+//
+static int8_t extract_sector(extract_writer *x, const uint8_t *sector, int8_t bad)
+{
+    size_t   index = x->nfilled % EXTRACT_BUFFERS;
+    uint8_t *dst   = x->buffers[index] + x->fill[index];
+
+    if(x->error)
+    {
+        printfileerror(NULL, x->filename);
+        return 1;
+    }
+    if(bad && opt_bad_marker && *opt_bad_marker)
+    {
+        size_t length = strlen(opt_bad_marker);
+        size_t i;
+        for(i = 0; i < x->record; i++) { dst[i] = (uint8_t)opt_bad_marker[i % length]; }
+        x->marked++;
+    }
+    else if(x->record == 2336) { memcpy(dst, sector + 0x10, 2336); }
+    else if(is_sync(sector) && sector[0x00F] == 0x01) { memcpy(dst, sector + 0x10, 2048); }
+    else if(is_sync(sector) && sector[0x00F] == 0x02 && (sector[0x012] & 0x20) == 0)
+    { memcpy(dst, sector + 0x18, 2048); }
+    else
+    {
+        memset(dst, 0, 2048);
+    }
+    x->sectors++;
+    x->fill[index] += x->record;
+    if(x->fill[index] == EXTRACT_BUFFER_SECTORS * x->record) { extract_submit(x); }
+    return 0;
+}
+
+//
+// Write what is left and free everything; write is zero if the file is
+// given up
+// Returns nonzero on error
+//
+static int8_t extract_close(extract_writer *x, int8_t write)
+{
+    const char *filename = x->filename;
+    size_t      i;
+
+    if(!filename) { return 0; }
+    if(write && x->out && x->fill[x->nfilled % EXTRACT_BUFFERS]) { extract_submit(x); }
+#ifdef HAVE_PTHREADS
+    if(x->out)
+    {
+        if(x->writing)
+        {
+            pthread_mutex_lock(&x->lock);
+            x->quit = 1;
+            pthread_cond_broadcast(&x->work);
+            pthread_mutex_unlock(&x->lock);
+            pthread_join(x->writer, NULL);
+        }
+        pthread_cond_destroy(&x->space);
+        pthread_cond_destroy(&x->work);
+        pthread_mutex_destroy(&x->lock);
+    }
+#endif
+    for(i = 0; i < EXTRACT_BUFFERS; i++) { free(x->buffers[i]); }
+    x->filename = NULL;
+    if(!x->out) { return 1; }
+    if(fclose(x->out) != 0) { x->error = 1; }
+    x->out = NULL;
+    if(!write || x->error)
+    {
+        if(write) { printfileerror(NULL, filename); }
+        remove(filename);
+        return 1;
+    }
+    printf("Wrote %s: %u sectors of %u bytes", filename, x->sectors, (unsigned)x->record);
+    if(x->marked) { printf(", %u of them marked bad", x->marked); }
+    printf("\n");
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Returns nonzero on error
+//
+static int8_t ecmify(const char *infilename)
+{
+    DPRINTF("Entering ecmify(\"%s\").\n", infilename);
+    int8_t returncode = 0;
+    int8_t cached     = 0;
+    int8_t cachekeyed = 0;
+    int8_t streaming  = !strcmp(infilename, "-");
+
+    FILE *in = NULL;
+    char  cachekey[4096];
+
+    uint8_t *queue                 = NULL;
+    size_t   queue_start_ofs       = 0;
+    size_t   queue_bytes_available = 0;
+
+    off_t input_file_length;
+    off_t input_bytes_checked = 0;
+    off_t input_bytes_queued  = 0;
+
+    ecc_batch batch;
+
+    cd_range range;
+    uint32_t rangesectors;
+    uint32_t samplesectors;
+
+    chunk_index  index;
+    index_chunk *chunk    = NULL;
+    int8_t       indexing = 0;
+    int8_t       chunking = 0;
+
+    hole_map holes;
+    uint32_t holesectors = 0;
+
+    readahead_state readahead;
+    off_t           in_pos = -1;
+
+    stream_events events;
+    int8_t        eventing = 0;
+
+    rescue_map rescuemap;
+    skip_map   skips;
+    uint32_t   skippedsectors = 0;
+    off_t      image_length;
+
+    ecm_writer ecm;
+
+    repair_list repairs;
+
+    extract_writer iso;
+    extract_writer raw2336;
+
+    size_t queue_size = ((size_t)(-1)) - 4095;
+    if((unsigned long)queue_size > 0x40000lu) { queue_size = (size_t)0x40000lu; }
+    if(job_device && job_device->rotational) { queue_size = ROTATIONAL_READ_SIZE; }
+    if((opt_index || job_hash_wanted) && queue_size < INDEX_CHUNK_BYTES) { queue_size = INDEX_CHUNK_BYTES; }
+
+    memset(&batch, 0, sizeof(batch));
+    memset(&index, 0, sizeof(index));
+    memset(&rescuemap, 0, sizeof(rescuemap));
+    memset(&skips, 0, sizeof(skips));
+    memset(&readahead, 0, sizeof(readahead));
+    memset(&ecm, 0, sizeof(ecm));
+    memset(&repairs, 0, sizeof(repairs));
+    memset(&iso, 0, sizeof(iso));
+    memset(&raw2336, 0, sizeof(raw2336));
+
+    //
+    // Allocate space for queue, on the NUMA node of the thread checking
+    // the image as it's first written here
+    //
+    DPRINTF("ecmify(): Allocation memory for queue.\n");
+    queue = malloc(queue_size);
+    if(!queue)
+    {
+        printf("Out of memory\n");
+        goto error;
+    }
+    if(ecc_bitslice && opt_level >= LEVEL_FULL)
+    {
+        batch.planes = malloc(BITSLICE_POSITIONS * 8 * sizeof(uint64_t));
+        if(!batch.planes)
+        {
+            printf("Out of memory\n");
+            goto error;
+        }
+    }
+
+    //
+    // Open both files
+    //
+    DPRINTF("ecmify(): Opening file \"%s\".\n", infilename);
+    if(streaming)
+    {
+        in = stdin;
+#if defined(_WIN32)
+        _setmode(_fileno(stdin), _O_BINARY);
+#endif
+    }
+    else
+    {
+        in = fopen(infilename, "rb");
+    }
+    if(!in) { goto error_in; }
+
+    printf("Checking %s...\n", streaming ? "standard input" : infilename);
+
+    if(opt_events_fd >= 0 && !job_event)
+    {
+        events.fd     = opt_events_fd;
+        events.name   = infilename;
+        events.range  = &range;
+        job_event     = stream_event;
+        job_event_ctx = &events;
+        eventing      = 1;
+    }
+
+    //
+    // Get the length of the input file, unknown for a pipe until it ends
+    //
+    DPRINTF("ecmify(): Seeking to end of file.\n");
+    if(!streaming && fseeko(in, 0, SEEK_END) != 0)
+    {
+        if(errno != ESPIPE) { goto error_in; }
+        streaming = 1;
+    }
+    if(streaming)
+    {
+        if(!whole_image() || opt_repair)
+        {
+            printf("Only whole images can be checked from a pipe, and not repaired\n");
+            goto error;
+        }
+        input_file_length = STREAM_LENGTH;
+    }
+    else
+    {
+        input_file_length = ftello(in);
+    }
+    DPRINTF("ecmify(): Got file length %d.\n", input_file_length);
+    if(input_file_length < 0) { goto error_in; }
+    image_length = input_file_length;
+
+    resetcounter(streaming ? 0 : input_file_length);
+
+    if(opt_skip_map && skip_map_load(&skips, opt_skip_map)) { goto error; }
+
+    cd_counters_reset();
+    previous_lba_valid = 0;
+
+    //
+    // Report unchanged images from the cache
+    //
+    // Keyed on the image as it is before any of it is read
+    cachekeyed = !streaming && cache_applicable() && !cache_entry_name(in, cachekey, sizeof(cachekey));
+    if(cachekeyed && !opt_ddrescue_map && !opt_ecm_out && !opt_extract_iso && !opt_extract_2336 &&
+       !cache_lookup(cachekey, &range))
+    {
+        cached = 1;
+        goto report;
+    }
+
+    //
+    // Restrict the check to the selected sectors, reading from the first
+    //
+    range.filesectors = (uint32_t)((input_file_length + 2351) / 2352);
+    range.first       = opt_start_lba < range.filesectors ? opt_start_lba : range.filesectors;
+    range.valid_in    = 0;
+    range.valid_out   = 0;
+    range.end         = opt_end_lba && opt_end_lba < range.filesectors ? opt_end_lba : range.filesectors;
+    if(range.end < range.first) { range.end = range.first; }
+    if(opt_shard_count)
+    {
+        uint32_t first = range.first;
+        uint32_t span  = range.end - range.first;
+        range.first    = first + (uint32_t)((uint64_t)span * (opt_shard - 1) / opt_shard_count);
+        range.end      = first + (uint32_t)((uint64_t)span * opt_shard / opt_shard_count);
+    }
+    if(range.first > 0 || range.end < range.filesectors)
+    { printf("Checking %u of %u sectors from sector %u\n", range.end - range.first, range.filesectors, range.first); }
+    input_bytes_queued = (off_t)range.first * 2352;
+    if((off_t)range.end * 2352 < input_file_length) { input_file_length = (off_t)range.end * 2352; }
+
+    //
+    // Only check a sample if asked to
+    //
+    rangesectors  = (uint32_t)((input_file_length - input_bytes_queued) / 2352);
+    samplesectors = sample_count(rangesectors);
+    if(!streaming) { readahead_begin(&readahead, in, input_bytes_queued, input_file_length, samplesectors == rangesectors); }
+    if(samplesectors < rangesectors)
+    {
+        // Printed so that the run can be repeated with --seed
+        uint64_t seed = opt_seed_set ? opt_seed : (uint64_t)time(NULL);
+        printf("Sampling %u of %u sectors with seed %llu...\n", samplesectors, rangesectors, (unsigned long long)seed);
+        if(sample_sectors(in, range.first, rangesectors, samplesectors, seed)) { goto error_in; }
+        range.imagesectors = rangesectors;
+        goto report;
+    }
+
+    //
+    // Only check the chunks changed since the index was saved
+    //
+    // The sectors of unchanged chunks aren't known for the mapfile, repair or extraction
+    if(opt_index && whole_image() && !streaming && !opt_ddrescue_map && !opt_repair && !opt_extract_iso &&
+       !opt_extract_2336)
+    {
+        indexing = 1;
+        index_load(&index, infilename);
+    }
+    chunking       = indexing || (job_hash_wanted && whole_image());
+    job_hash       = IMAGE_HASH_SEED;
+    job_hash_valid = 0;
+
+    // Chunk hashes, the ECM file and extracted data need every byte, holes or not
+    holes.fd    = fileno(in);
+    holes.start = holes.end =
+        chunking || streaming || opt_ecm_out || opt_extract_iso || opt_extract_2336 ? input_file_length : 0;
+
+    if(opt_ecm_out && ecm_open(&ecm, opt_ecm_out)) { goto error; }
+    if(opt_extract_iso && extract_open(&iso, opt_extract_iso, 2048)) { goto error; }
+    if(opt_extract_2336 && extract_open(&raw2336, opt_extract_2336, 2336)) { goto error; }
 
     DPRINTF("ecmify(): Entering main loop.\n");
     for(;;)
     {
-        //
-        // Refill queue if necessary
-        //
-        if((queue_bytes_available < 2352) &&
-           (((off_t)queue_bytes_available) < (input_file_length - input_bytes_queued)))
+        // A chunk is hashed whole before it is checked
+        size_t need = chunking && totalsectors % INDEX_CHUNK_SECTORS == 0 ? INDEX_CHUNK_BYTES : 2352;
+
+        //
+        // Count the sectors in a hole of the file without reading them
+        //
+        off_t pos = input_bytes_queued - (off_t)queue_bytes_available;
+        hole_find(&holes, pos, input_file_length);
+        if(pos >= holes.start && pos < holes.end)
+        {
+            uint32_t sectors = (uint32_t)((holes.end - pos) / 2352);
+            nondatasectors += sectors;
+            totalsectors += sectors;
+            holesectors += sectors;
+            previous_lba_valid = 0;
+            input_bytes_checked += holes.end - pos;
+            if(holes.end - pos <= (off_t)queue_bytes_available)
+            {
+                queue_start_ofs += (size_t)(holes.end - pos);
+                queue_bytes_available -= (size_t)(holes.end - pos);
+            }
+            else
+            {
+                queue_start_ofs       = 0;
+                queue_bytes_available = 0;
+                input_bytes_queued    = holes.end;
+            }
+            continue;
+        }
+
+        //
+        // Refill queue if necessary
+        //
+        if((queue_bytes_available < need) && (input_bytes_queued < input_file_length))
+        {
+            DPRINTF("ecmify(): Refilling queue.\n");
+            //
+            // We need to read more data
+            //
+            off_t willread = input_file_length - input_bytes_queued;
+            off_t maxread  = queue_size - queue_bytes_available;
+            if(willread > maxread)
+            {
+                DPRINTF("Will read maximum.\n");
+                willread = maxread;
+            }
+            // Stop at the next hole
+            if(holes.start > input_bytes_queued && willread > holes.start - input_bytes_queued)
+            { willread = holes.start - input_bytes_queued; }
+
+            if(queue_start_ofs > 0)
+            {
+                memmove(queue, queue + queue_start_ofs, queue_bytes_available);
+                queue_start_ofs = 0;
+            }
+            if(willread)
+            {
+                setcounter_analyze(input_bytes_queued);
+
+                if(job_cancel && *job_cancel) { goto error; }
+                if(streaming)
+                {
+                    // Check what has arrived as soon as there is a sector of it
+                    willread = stream_read(in, queue + queue_bytes_available, need - queue_bytes_available, (size_t)willread);
+                    if(willread < 0) { goto error_in; }
+                    if(willread < (off_t)(need - queue_bytes_available))
+                    { input_file_length = input_bytes_queued + willread; }
+                    throttle_read((size_t)willread);
+                }
+                else
+                {
+                    throttle_read((size_t)willread);
+                    device_read_begin();
+                    // Only seek when a hole or the start of the range was skipped
+                    if((in_pos != input_bytes_queued && fseeko(in, input_bytes_queued, SEEK_SET) != 0) ||
+                       fread(queue + queue_bytes_available, 1, willread, in) != (size_t)willread)
+                    {
+                        device_read_end();
+                        goto error_in;
+                    }
+                    device_read_end();
+                    readahead_advance(&readahead, input_bytes_queued + willread);
+                }
+
+                if(opt_ecm_out && ecm_write(&ecm, queue + queue_bytes_available, (size_t)willread)) { goto error; }
+
+                input_bytes_queued += willread;
+                queue_bytes_available += willread;
+                in_pos = input_bytes_queued;
+            }
+        }
+
+        if(queue_bytes_available < 2352)
+        {
+            DPRINTF("ecmify(): No data left in queue.\n");
+            //
+            // No data left to read -> quit
+            //
+            if(queue_bytes_available)
+            { printf("Ignoring %u bytes after the last whole sector\n", (unsigned)queue_bytes_available); }
+            // A tail starting a chunk of its own still counts in the image hash
+            if(chunking && queue_bytes_available && totalsectors % INDEX_CHUNK_SECTORS == 0)
+            { job_hash = image_hash_add(job_hash, queue + queue_start_ofs, queue_bytes_available); }
+            break;
+        }
+
+        uint8_t *sector = queue + queue_start_ofs;
+
+        if(chunking && totalsectors % INDEX_CHUNK_SECTORS == 0)
+        {
+            size_t   size = queue_bytes_available < INDEX_CHUNK_BYTES ? queue_bytes_available : INDEX_CHUNK_BYTES;
+            uint64_t hash = chunk_hash(sector, size);
+            job_hash      = hash_round(job_hash, hash);
+            if(chunk) { index_end_chunk(chunk); }
+            chunk = indexing ? index_begin_chunk(&index, hash) : NULL;
+            if(indexing && !chunk)
+            {
+                printf("Out of memory\n");
+                goto error;
+            }
+            if(indexing && index_reuse_chunk(&index, chunk))
+            {
+                // The saved counters include the chunk's sectors
+                chunk = NULL;
+                input_bytes_checked += size;
+                queue_start_ofs += size;
+                queue_bytes_available -= size;
+                continue;
+            }
+        }
+
+        if(skip_map_covers(&skips, (off_t)(range.first + totalsectors) * 2352))
+        {
+            // ddrescue didn't read it, the re-dump will
+            nondatasectors++;
+            skippedsectors++;
+            previous_lba_valid = 0;
+        }
+        else
+        {
+            uint32_t errors     = totalerrors;
+            uint32_t edc_errors = total_edc_err;
+
+            if(batch.planes && totalsectors - batch.first >= batch.count)
+            { ecc_batch_fill(&batch, sector, queue_bytes_available, totalsectors); }
+
+            check_sector(sector, totalsectors, &batch);
+
+            if(opt_ddrescue_map && rescue_map_mark(&rescuemap, range.first + totalsectors, totalerrors != errors ? '-' : '+'))
+            {
+                printf("Out of memory\n");
+                goto error;
+            }
+            if(opt_repair && totalerrors != errors &&
+               repair_add(&repairs, sector, (off_t)(range.first + totalsectors) * 2352))
+            {
+                printf("Out of memory\n");
+                goto error;
+            }
+            if(opt_extract_iso && extract_sector(&iso, sector, total_edc_err != edc_errors)) { goto error; }
+            if(opt_extract_2336 && extract_sector(&raw2336, sector, total_edc_err != edc_errors)) { goto error; }
+        }
+
+        //
+        // Advance to the next sector
+        //
+        totalsectors++;
+        if(totalsectors == 1)
+        {
+            range.lba_in   = previous_lba;
+            range.valid_in = previous_lba_valid;
+        }
+        input_bytes_checked += 2352;
+        queue_start_ofs += 2352;
+        queue_bytes_available -= 2352;
+
+        DPRINTF("ecmify.totalsectors = %d\n", totalsectors);
+        DPRINTF("ecmify.input_bytes_checked = %d\n", input_bytes_checked);
+        DPRINTF("ecmify.queue_start_ofs = %d\n", queue_start_ofs);
+        DPRINTF("ecmify.queue_bytes_available = %d\n", queue_bytes_available);
+    }
+
+    range.imagesectors = totalsectors;
+    range.lba_out      = previous_lba;
+    range.valid_out    = previous_lba_valid;
+    if(opt_ecm_out && ecm_close(&ecm, 1)) { goto error; }
+    if(opt_extract_iso && extract_close(&iso, 1)) { goto error; }
+    if(opt_extract_2336 && extract_close(&raw2336, 1)) { goto error; }
+    if(streaming)
+    {
+        range.filesectors = range.end = totalsectors;
+        image_length                  = input_file_length;
+    }
+    else if(!cached && cachekeyed) { cache_store(in, cachekey, infilename, &range); }
+    if(holesectors) { printf("%u sectors in holes of the sparse file counted without reading\n", holesectors); }
+    if(skippedsectors) { printf("%u sectors ddrescue didn't read skipped\n", skippedsectors); }
+    if(opt_ddrescue_map && rescue_map_save(&rescuemap, opt_ddrescue_map, infilename, image_length)) { goto error; }
+#ifdef HAVE_REPAIR
+    if(opt_repair)
+    {
+        if(repair_apply(&repairs, infilename, image_length)) { goto error; }
+        printf("Repaired %u of %u failing sectors", (unsigned)repairs.count, (unsigned)(repairs.count + repairs.failed));
+        if(repairs.count) { printf("; undo with --undo"); }
+        printf("\n");
+    }
+#endif
+    if(chunking)
+    {
+        job_hash       = image_hash_end(job_hash, input_file_length);
+        job_hash_valid = 1;
+    }
+    if(indexing)
+    {
+        if(chunk) { index_end_chunk(chunk); }
+        if(index.reused)
+        { printf("%u of %u chunks unchanged since the last check\n", index.reused, (unsigned)index.count); }
+        index_save(&index, infilename);
+    }
+
+report:
+    output_begin();
+    if(job_name) { printf("\n%s:", infilename); }
+    print_report(infilename, range.imagesectors);
+    if(opt_partial && write_partial(opt_partial, infilename, &range))
+    {
+        output_end();
+        goto error;
+    }
+
+    //
+    // Success
+    //
+    printf("Done\n");
+    output_end();
+    returncode = 0;
+    goto done;
+
+error_in:
+    printfileerror(in, infilename);
+    goto error;
+
+error:
+    returncode = 1;
+    goto done;
+
+done:
+    if(queue != NULL) { free(queue); }
+    if(batch.planes != NULL) { free(batch.planes); }
+    index_free(&index);
+    free(rescuemap.runs);
+    free(skips.regions);
+    free(repairs.entries);
+    ecm_close(&ecm, 0);
+    extract_close(&iso, 0);
+    extract_close(&raw2336, 0);
+    if(in != NULL && in != stdin) { fclose(in); }
+    if(eventing)
+    {
+        job_event     = NULL;
+        job_event_ctx = NULL;
+    }
+
+    return returncode;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Batch runs
+//
+// With --dedupe, identical copies of an image are checked once.  Images
+// are first told apart cheaply by their size and the hashes of a few
+// sectors spread over them.  The first image of each group of look-alikes
+// is checked, hashing all of it on the way; the others are then only read
+// and hashed, and report the first one's result if the hashes match (or
+// are checked themselves if they don't).
+//
+#define FINGERPRINT_SECTORS 5
+
+typedef struct
+{
+    char      *filename;
+    io_device *device;
+    size_t     round;
+    size_t     devindex;
+    size_t     position;
+    int        level;
+    uint64_t   fingerprint;
+    int8_t     fingerprinted;
+    size_t     original;
+    uint64_t   hash;
+    int8_t     hashed;
+    uint32_t   counters[CD_COUNTER_COUNT];
+    int8_t     failed;
+} batch_job;
+
+typedef struct
+{
+    batch_job *jobs;
+    size_t    *list;
+} batch_pass;
+
+static int compare_batch_order(const void *a, const void *b)
+{
+    const batch_job *ja = a;
+    const batch_job *jb = b;
+    if(ja->round != jb->round) { return ja->round < jb->round ? -1 : 1; }
+    if(ja->devindex != jb->devindex) { return ja->devindex < jb->devindex ? -1 : 1; }
+    return ja->position < jb->position ? -1 : ja->position > jb->position;
+}
+
+typedef struct
+{
+    uint64_t fingerprint;
+    size_t   job;
+} batch_print;
+
+static int compare_batch_prints(const void *a, const void *b)
+{
+    const batch_print *pa = a;
+    const batch_print *pb = b;
+    if(pa->fingerprint != pb->fingerprint) { return pa->fingerprint < pb->fingerprint ? -1 : 1; }
+    return pa->job < pb->job ? -1 : pa->job > pb->job;
+}
+
+//
+// Set the thread up for the job; the caller clears it with job_end()
+//
+static void job_begin(batch_job *job)
+{
+    job_name   = job->filename;
+    job_device = job->device;
+    opt_level  = job->level;
+}
+
+static void job_end(void)
+{
+    job_name        = NULL;
+    job_device      = NULL;
+    job_hash_wanted = 0;
+}
+
+//
+// Size and hashes of a few sectors spread over the image
+//
+static void batch_fingerprint(void *ctx, size_t index)
+{
+    batch_pass *pass = ctx;
+    batch_job  *job  = &pass->jobs[pass->list[index]];
+    uint8_t     sector[2352];
+    FILE       *in;
+    off_t       length;
+    off_t       sectors;
+    uint64_t    hash;
+    size_t      s;
+
+    job_begin(job);
+    in = fopen(job->filename, "rb");
+    if(!in || fseeko(in, 0, SEEK_END) != 0 || (length = ftello(in)) < 0) { goto done; }
+    sectors = length / 2352;
+    hash    = image_hash_end(IMAGE_HASH_SEED, length);
+    for(s = 0; sectors && s < FINGERPRINT_SECTORS; s++)
+    {
+        off_t lba = (sectors - 1) * (off_t)s / (FINGERPRINT_SECTORS - 1);
+        throttle_read(sizeof(sector));
+        device_read_begin();
+        if(fseeko(in, lba * 2352, SEEK_SET) != 0 || fread(sector, 1, sizeof(sector), in) != sizeof(sector))
+        {
+            device_read_end();
+            goto done;
+        }
+        device_read_end();
+        hash = image_hash_add(hash, sector, sizeof(sector));
+    }
+    job->fingerprint   = hash;
+    job->fingerprinted = 1;
+
+done:
+    if(in) { fclose(in); }
+    job_end();
+}
+
+//
+// Hash the whole image the way ecmify() does
+// Returns nonzero on error
+//
+static int8_t batch_hash(const char *filename, uint64_t *hash)
+{
+    uint8_t *chunk = malloc(INDEX_CHUNK_BYTES);
+    FILE    *in    = fopen(filename, "rb");
+    off_t    length;
+    off_t    done = 0;
+    int8_t   returncode = 1;
+
+    if(!chunk || !in || fseeko(in, 0, SEEK_END) != 0 || (length = ftello(in)) < 0) { goto error; }
+    *hash = IMAGE_HASH_SEED;
+    while(done < length)
+    {
+        size_t size = length - done < INDEX_CHUNK_BYTES ? (size_t)(length - done) : INDEX_CHUNK_BYTES;
+        throttle_read(size);
+        device_read_begin();
+        if(fseeko(in, done, SEEK_SET) != 0 || fread(chunk, 1, size, in) != size)
+        {
+            device_read_end();
+            goto error;
+        }
+        device_read_end();
+        *hash = image_hash_add(*hash, chunk, size);
+        done += size;
+    }
+    *hash      = image_hash_end(*hash, length);
+    returncode = 0;
+
+error:
+    free(chunk);
+    if(in) { fclose(in); }
+    return returncode;
+}
+
+//
+// Check an image, or report the result of the image it duplicates
+//
+static void batch_check(void *ctx, size_t index)
+{
+    batch_pass *pass     = ctx;
+    batch_job  *job      = &pass->jobs[pass->list[index]];
+    batch_job  *original = &pass->jobs[job->original];
+
+    job_begin(job);
+    if(original != job && original->hashed && !batch_hash(job->filename, &job->hash) && job->hash == original->hash)
+    {
+        cd_counters_reset();
+        cd_counters_add(original->counters);
+        output_begin();
+        printf("\n%s:\nIdentical to %s, using its result", job->filename, original->filename);
+        print_report(job->filename, totalsectors);
+        printf("Done\n");
+        output_end();
+    }
+    else
+    {
+        job_hash_wanted = opt_dedupe;
+        job->failed     = ecmify(job->filename);
+        job->hash       = job_hash;
+        job->hashed     = !job->failed && job_hash_valid;
+        cd_counters_get(job->counters);
+    }
+    job_end();
+}
+
+//
+// Check count images on the pool, one per thread, taking turns between the
+// devices they are on so that the images checked at once are spread over
+// as many devices as possible
+// Returns nonzero if any of them could not be checked
+//
+static int8_t batch_run(size_t count, char **filenames, workpool *pool)
+{
+    io_device *devices   = calloc(count, sizeof(io_device));
+    size_t    *perdevice = calloc(count, sizeof(size_t));
+    size_t    *list      = malloc(count * sizeof(size_t));
+    batch_job *jobs      = calloc(count, sizeof(batch_job));
+    batch_pass pass;
+    size_t     ndevices   = 0;
+    size_t     rotational = 0;
+    size_t     first      = 0;
+    size_t     duplicates = 0;
+    size_t     i;
+    size_t     j;
+    int8_t     returncode = 1;
+
+    if(!devices || !perdevice || !list || !jobs)
+    {
+        printf("Out of memory\n");
+        goto done;
+    }
+
+    //
+    // Group the images by device
+    //
+    for(i = 0; i < count; i++)
+    {
+        struct stat st;
+        size_t      d = count;
+        if(stat(filenames[i], &st) == 0)
+        {
+            for(d = 0; d < ndevices && devices[d].dev != st.st_dev; d++) {}
+            if(d == ndevices)
+            {
+                devices[d].dev        = st.st_dev;
+                devices[d].rotational = device_rotational(st.st_dev);
+#ifdef HAVE_PTHREADS
+                pthread_mutex_init(&devices[d].lock, NULL);
+                pthread_cond_init(&devices[d].idle, NULL);
+#endif
+                rotational += devices[d].rotational;
+                ndevices++;
+            }
+        }
+        jobs[i].filename = filenames[i];
+        jobs[i].device   = d < count ? &devices[d] : NULL;
+        jobs[i].devindex = d;
+        jobs[i].round    = d < count ? perdevice[d]++ : 0;
+        jobs[i].position = i;
+        jobs[i].level    = opt_cli_level;
+    }
+    qsort(jobs, count, sizeof(batch_job), compare_batch_order);
+
+    printf("Checking %u images on %u devices (%u rotational)...\n",
+           (unsigned)count,
+           (unsigned)ndevices,
+           (unsigned)rotational);
+    fflush(stdout);
+
+    pass.jobs = jobs;
+    pass.list = list;
+    for(i = 0; i < count; i++)
+    {
+        jobs[i].original = i;
+        list[i]          = i;
+    }
+
+    //
+    // Find look-alike images; each is checked after the first of its group
+    //
+    if(opt_dedupe && whole_image())
+    {
+        batch_print *prints = malloc(count * sizeof(batch_print));
+        if(!prints)
+        {
+            printf("Out of memory\n");
+            goto done;
+        }
+        pool_run(pool, batch_fingerprint, &pass, count);
+        for(i = 0; i < count; i++)
+        {
+            prints[i].fingerprint = jobs[i].fingerprint;
+            prints[i].job         = i;
+        }
+        qsort(prints, count, sizeof(batch_print), compare_batch_prints);
+        for(i = j = 0; i < count; i++)
+        {
+            if(prints[i].fingerprint != prints[j].fingerprint) { j = i; }
+            if(jobs[prints[i].job].fingerprinted && jobs[prints[j].job].fingerprinted)
+            { jobs[prints[i].job].original = prints[j].job; }
+        }
+        free(prints);
+        for(i = 0; i < count; i++)
+        {
+            if(jobs[i].original == i) { list[first++] = i; }
+        }
+        for(i = 0; i < count; i++)
+        {
+            if(jobs[i].original != i) { list[first + duplicates++] = i; }
+        }
+        if(duplicates) { printf("%u images look like copies of others\n", (unsigned)duplicates); }
+    }
+    else
+    {
+        first = count;
+    }
+
+    pool_run(pool, batch_check, &pass, first);
+    pass.list = list + first;
+    pool_run(pool, batch_check, &pass, duplicates);
+
+    returncode = 0;
+    for(i = 0; i < count; i++) { returncode |= jobs[i].failed; }
+
+done:
+#ifdef HAVE_PTHREADS
+    for(i = 0; i < ndevices; i++)
+    {
+        pthread_mutex_destroy(&devices[i].lock);
+        pthread_cond_destroy(&devices[i].idle);
+    }
+#endif
+    free(devices);
+    free(perdevice);
+    free(list);
+    free(jobs);
+    return returncode;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Comparing dumps
+//
+// "edccchk --compare a.bin b.bin ..." reads several dumps of the same disc
+// in lockstep, a batch of sectors at a time: every dump is read by a
+// thread of its own, then the copies of each sector are verified and
+// compared on all threads.  Sectors whose copies differ are listed with
+// how each copy fared.  With --merge-out FILE, every sector of FILE is
+// taken from the first dump whose copy passes all its checks or, if none
+// does or there is nothing to check (audio), from the copy most dumps
+// agree on.  A dump shorter than the others is missing its last sectors.
+//
+#define COMPARE_MAX_IMAGES 32
+#define COMPARE_BATCH_SECTORS 1024
+
+typedef struct
+{
+    const char *filename;
+    FILE       *in;
+    uint32_t    filesectors;
+    uint8_t    *buffer;
+    uint32_t    sectors;
+    uint32_t    failed;
+    int8_t      error;
+} compare_image;
+
+typedef struct
+{
+    uint32_t present;
+    uint32_t good;
+    uint32_t bad;
+    int8_t   differ;
+    uint8_t  chosen;
+} compare_sector;
+
+typedef struct
+{
+    compare_image  *images;
+    size_t          count;
+    uint32_t        first;
+    compare_sector *sectors;
+} compare_state;
+
+static void compare_read(void *ctx, size_t index)
+{
+    compare_state *state = ctx;
+    compare_image *image = &state->images[index];
+
+    image->sectors = 0;
+    if(image->filesectors <= state->first) { return; }
+    image->sectors = image->filesectors - state->first;
+    if(image->sectors > COMPARE_BATCH_SECTORS) { image->sectors = COMPARE_BATCH_SECTORS; }
+    throttle_read((size_t)image->sectors * 2352);
+    if(fread(image->buffer, 2352, image->sectors, image->in) != image->sectors) { image->error = 1; }
+}
+
+static void compare_verify(void *ctx, size_t index)
+{
+    compare_state  *state  = ctx;
+    compare_sector *result = &state->sectors[index];
+    const uint8_t  *copy[COMPARE_MAX_IMAGES];
+    size_t          agree  = 0;
+    size_t          i;
+    size_t          j;
+
+    memset(result, 0, sizeof(*result));
+    for(i = 0; i < state->count; i++)
+    {
+        int ok;
+        if(state->images[i].sectors <= index) { continue; }
+        copy[i] = state->images[i].buffer + index * 2352;
+        ok      = sector_verify(copy[i]);
+        if(result->present && memcmp(copy[i], copy[result->chosen], 2352) != 0) { result->differ = 1; }
+        if(!result->present) { result->chosen = (uint8_t)i; }
+        result->present |= (uint32_t)1 << i;
+        if(ok > 0) { result->good |= (uint32_t)1 << i; }
+        if(!ok) { result->bad |= (uint32_t)1 << i; }
+    }
+    if(!result->differ) { return; }
+
+    //
+    // Take the first copy that verifies, or else the one most copies match
+    //
+    for(i = 0; i < state->count; i++)
+    {
+        if(result->good & ((uint32_t)1 << i))
+        {
+            result->chosen = (uint8_t)i;
+            return;
+        }
+    }
+    for(i = 0; i < state->count; i++)
+    {
+        size_t matches = 0;
+        if(!(result->present & ((uint32_t)1 << i))) { continue; }
+        for(j = 0; j < state->count; j++)
+        {
+            if((result->present & ((uint32_t)1 << j)) && !memcmp(copy[i], copy[j], 2352)) { matches++; }
+        }
+        if(matches > agree)
+        {
+            agree          = matches;
+            result->chosen = (uint8_t)i;
+        }
+    }
+}
+
+//
+// Show how each copy of a sector that differs fared
+//
+static void compare_print(const compare_state *state, uint32_t sectornumber, const compare_sector *result)
+{
+    size_t i;
+    fprintf(stderr, "Sector %u differs:", sectornumber);
+    for(i = 0; i < state->count; i++)
+    {
+        uint32_t    bit  = (uint32_t)1 << i;
+        const char *what = !(result->present & bit) ? "missing"
+                           : result->good & bit     ? "good"
+                           : result->bad & bit      ? "failed"
+                                                    : "not verifiable";
+        fprintf(stderr, "%s %s %s", i ? "," : "", state->images[i].filename, what);
+    }
+    fprintf(stderr, "\n");
+}
+
+//
+// Returns nonzero on error
+//
+static int8_t compare_run(size_t count, char **filenames, workpool *pool)
+{
+    int8_t         returncode = 1;
+    compare_state  state;
+    compare_image *images  = calloc(count, sizeof(compare_image));
+    FILE          *out     = NULL;
+    uint32_t       sectors = 0;
+    uint32_t       differ  = 0;
+    uint32_t       failing = 0;
+    uint32_t       merged_failing = 0;
+    size_t         i;
+
+    memset(&state, 0, sizeof(state));
+    state.sectors = malloc(COMPARE_BATCH_SECTORS * sizeof(compare_sector));
+    if(!images || !state.sectors)
+    {
+        printf("Out of memory\n");
+        goto done;
+    }
+    state.images = images;
+    state.count  = count;
+
+    //
+    // Open the dumps; the longest gives the number of sectors
+    //
+    for(i = 0; i < count; i++)
+    {
+        off_t length;
+        images[i].filename = filenames[i];
+        images[i].in       = fopen(filenames[i], "rb");
+        if(!images[i].in || fseeko(images[i].in, 0, SEEK_END) != 0 || (length = ftello(images[i].in)) < 0 ||
+           fseeko(images[i].in, 0, SEEK_SET) != 0)
+        {
+            printfileerror(images[i].in, filenames[i]);
+            goto done;
+        }
+        images[i].filesectors = (uint32_t)(length / 2352);
+        images[i].buffer      = malloc((size_t)COMPARE_BATCH_SECTORS * 2352);
+        if(!images[i].buffer)
+        {
+            printf("Out of memory\n");
+            goto done;
+        }
+        if(images[i].filesectors > sectors) { sectors = images[i].filesectors; }
+    }
+    printf("Comparing %u dumps of %u sectors...\n", (unsigned)count, sectors);
+    for(i = 0; i < count; i++)
+    {
+        if(images[i].filesectors < sectors)
+        { printf("%s is %u sectors short\n", filenames[i], sectors - images[i].filesectors); }
+    }
+
+    if(opt_merge_out)
+    {
+        out = fopen(opt_merge_out, "wb");
+        if(!out)
+        {
+            printfileerror(out, opt_merge_out);
+            goto done;
+        }
+    }
+
+    resetcounter((off_t)sectors * 2352);
+    for(state.first = 0; state.first < sectors; state.first += COMPARE_BATCH_SECTORS)
+    {
+        uint32_t n = sectors - state.first < COMPARE_BATCH_SECTORS ? sectors - state.first : COMPARE_BATCH_SECTORS;
+        uint32_t s;
+
+        setcounter_analyze((off_t)state.first * 2352);
+        pool_run(pool, compare_read, &state, count);
+        for(i = 0; i < count; i++)
+        {
+            if(images[i].error)
+            {
+                printfileerror(images[i].in, filenames[i]);
+                goto done;
+            }
+        }
+        pool_run(pool, compare_verify, &state, n);
+
+        //
+        // Report and merge in sector order once the whole batch is done
+        //
+        for(s = 0; s < n; s++)
+        {
+            const compare_sector *result = &state.sectors[s];
+            for(i = 0; i < count; i++)
+            {
+                if(result->bad & ((uint32_t)1 << i)) { images[i].failed++; }
+            }
+            if(result->bad && !result->good) { failing++; }
+            if(result->differ)
+            {
+                differ++;
+                compare_print(&state, state.first + s, result);
+            }
+            if(out)
+            {
+                if(result->bad & ((uint32_t)1 << result->chosen)) { merged_failing++; }
+                if(fwrite(images[result->chosen].buffer + (size_t)s * 2352, 1, 2352, out) != 2352)
+                {
+                    printfileerror(out, opt_merge_out);
+                    goto done;
+                }
+            }
+        }
+    }
+
+    printf("\n-----------------Comparison:------------------\n");
+    printf("Dumps................... %u\n", (unsigned)count);
+    printf("Sectors................. %u\n", sectors);
+    printf("Sectors that differ..... %u\n", differ);
+    printf("Sectors failing in all.. %u\n", failing);
+    printf("Failing sectors per dump:\n");
+    for(i = 0; i < count; i++) { printf("\t%s: %u\n", filenames[i], images[i].failed); }
+    if(out) { printf("Failing in merged image. %u\n", merged_failing); }
+    printf("----------------------------------------------\n");
+
+    if(out)
+    {
+        FILE *merged = out;
+        out          = NULL;
+        if(ferror(merged) || fclose(merged) != 0)
+        {
+            printfileerror(NULL, opt_merge_out);
+            goto done;
+        }
+        printf("Merged image written to %s\n", opt_merge_out);
+    }
+    printf("Done\n");
+    returncode = 0;
+
+done:
+    if(out) { fclose(out); }
+    if(images)
+    {
+        for(i = 0; i < count; i++)
+        {
+            if(images[i].in) { fclose(images[i].in); }
+            free(images[i].buffer);
+        }
+    }
+    free(images);
+    free(state.sectors);
+    return returncode;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Server
+//
+// "edccchk --serve SOCKET" listens on a Unix socket and checks CD images
+// for its clients, with the tables set up once and a fixed set of
+// --threads worker threads.  A client sends one JSON object per line:
+//
+//   {"id": "7", "path": "/images/a.bin", "level": "paranoid"}
+//   {"cancel": "7"}
+//
+// and gets JSON lines back for each request, all carrying its id: status
+// "queued", then "checking", an "event" line per failing sector, and last
+// "done" with the counters, or "failed", "cancelled" or "rejected".  At
+// most --max-queue requests wait for a thread; more are rejected.  The
+// requests of a client that disconnects are cancelled.  Reports and CSV
+// rows are written as for any other check, and the final line of every
+// request goes to the --json file, with the image's path.
+//
+// "edccchk --watch DIR" queues the files written to or moved into DIR for
+// the same workers, waiting for room in the queue rather than dropping
+// any.  It may be combined with --serve.
+//
+#ifdef HAVE_SERVER
+#define SERVER_LINE_MAX 16384
+
+static size_t      opt_max_queue = 1024;
+static const char *opt_json      = NULL;
+
+static FILE *json_sink = NULL;
+
+typedef struct
+{
+    int             fd;
+    pthread_mutex_t lock;
+    size_t          refs;
+    int8_t          closed;
+} server_client;
+
+typedef struct server_request
+{
+    struct server_request *next;
+    server_client         *client;
+    char                   id[128];
+    char                   path[4096];
+    int                    level;
+    volatile int8_t        cancelled;
+} server_request;
+
+static struct
+{
+    pthread_mutex_t  lock;
+    pthread_cond_t   wake;
+    pthread_cond_t   space;
+    server_request  *head;
+    server_request  *tail;
+    size_t           queued;
+    server_request **running;
+    size_t           nrunning;
+    int8_t           stopping;
+} server = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0, NULL, 0, 0};
+
+static volatile sig_atomic_t server_quit = 0;
+
+// Written to when the server stops and never read, so it stays readable for
+// every thread polling it, however late it looks
+static int server_wakefd[2] = {-1, -1};
+
+//
+// Signals stop the accept loop of the main thread, so the others block them
+//
+static void server_block_signals(void)
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+static void server_wake(void)
+{
+    int e = errno;
+    if(server_wakefd[1] >= 0 && write(server_wakefd[1], "", 1) < 0) {}
+    errno = e;
+}
+
+static void server_signal(int sig)
+{
+    (void)sig;
+    server_quit = 1;
+    server_wake();
+}
+
+//
+// Quoted JSON string for src
+//
+static void json_quote(char *dst, size_t size, const char *src)
+{
+    size_t n = 0;
+    if(size < 3) { return; }
+    dst[n++] = '"';
+    for(; *src && n + 8 < size; src++)
+    {
+        uint8_t c = (uint8_t)*src;
+        if(c == '"' || c == '\\')
+        {
+            dst[n++] = '\\';
+            dst[n++] = c;
+        }
+        else if(c < 0x20) { n += snprintf(dst + n, size - n, "\\u%04x", c); }
+        else
+        {
+            dst[n++] = c;
+        }
+    }
+    dst[n++] = '"';
+    dst[n]   = 0;
+}
+
+//
+// Value of the 4 hex digits of a \u escape at p, or -1 if they aren't there
+//
+static long json_hex4(const char *p)
+{
+    long u = 0;
+    int  i;
+    for(i = 0; i < 4; i++)
+    {
+        u <<= 4;
+        if(p[i] >= '0' && p[i] <= '9') { u |= p[i] - '0'; }
+        else if(p[i] >= 'a' && p[i] <= 'f') { u |= p[i] - 'a' + 10; }
+        else if(p[i] >= 'A' && p[i] <= 'F') { u |= p[i] - 'A' + 10; }
+        else { return -1; }
+    }
+    return u;
+}
+
+//
+// Decode the JSON string at *pp, just after its opening quote, into out as
+// UTF-8 (whole characters up to size bytes with the terminator) and move *pp
+// past its closing quote; returns nonzero if the string is malformed
+//
+static int8_t json_string(const char **pp, char *out, size_t size)
+{
+    const char *p    = *pp;
+    size_t      n    = 0;
+    size_t      room = size ? size - 1 : 0;
+    while(*p != '"')
+    {
+        unsigned char utf8[4];
+        size_t        len = 1;
+        long          c   = (unsigned char)*p++;
+        if(!c) { return 1; }
+        if(c == '\\')
+        {
+            c = (unsigned char)*p++;
+            switch(c)
+            {
+            case '"':
+            case '\\':
+            case '/': break;
+            case 'b': c = '\b'; break;
+            case 'f': c = '\f'; break;
+            case 'n': c = '\n'; break;
+            case 'r': c = '\r'; break;
+            case 't': c = '\t'; break;
+            case 'u':
+                c = json_hex4(p);
+                if(c < 0) { return 1; }
+                p += 4;
+                // Characters outside the BMP come as a high and a low surrogate
+                if(c >= 0xD800 && c < 0xDC00)
+                {
+                    long low = p[0] == '\\' && p[1] == 'u' ? json_hex4(p + 2) : -1;
+                    if(low < 0xDC00 || low >= 0xE000) { return 1; }
+                    c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                    p += 6;
+                }
+                else if(c >= 0xDC00 && c < 0xE000) { return 1; }
+                if(c >= 0x10000)
+                {
+                    utf8[0] = 0xF0 | (c >> 18);
+                    utf8[1] = 0x80 | ((c >> 12) & 0x3F);
+                    utf8[2] = 0x80 | ((c >> 6) & 0x3F);
+                    utf8[3] = 0x80 | (c & 0x3F);
+                    len     = 4;
+                }
+                else if(c >= 0x800)
+                {
+                    utf8[0] = 0xE0 | (c >> 12);
+                    utf8[1] = 0x80 | ((c >> 6) & 0x3F);
+                    utf8[2] = 0x80 | (c & 0x3F);
+                    len     = 3;
+                }
+                else if(c >= 0x80)
+                {
+                    utf8[0] = 0xC0 | (c >> 6);
+                    utf8[1] = 0x80 | (c & 0x3F);
+                    len     = 2;
+                }
+                break;
+            default: return 1;
+            }
+        }
+        if(len == 1) { utf8[0] = (unsigned char)c; }
+        if(n + len <= room)
+        {
+            memcpy(out + n, utf8, len);
+            n += len;
+        }
+        else
+        {
+            room = n;
+        }
+    }
+    if(size) { out[n] = 0; }
+    *pp = p + 1;
+    return 0;
+}
+
+//
+// Find key in a flat JSON object and copy its value, unquoted if it is a
+// string; returns nonzero if it is there
+//
+static int8_t json_field(const char *json, const char *key, char *value, size_t size)
+{
+    const char *p = json;
+    while(*p && *p != '{') { p++; }
+    if(!*p) { return 0; }
+    p++;
+    for(;;)
+    {
+        char   name[64];
+        size_t n     = 0;
+        int8_t found = 0;
+
+        while(*p == ' ' || *p == '\t' || *p == ',') { p++; }
+        if(*p++ != '"' || json_string(&p, name, sizeof(name))) { return 0; }
+        while(*p == ' ' || *p == '\t') { p++; }
+        if(*p++ != ':') { return 0; }
+        while(*p == ' ' || *p == '\t') { p++; }
+
+        found = !strcmp(name, key);
+        if(*p == '"')
         {
-            DPRINTF("ecmify(): Refilling queue.\n");
-            //
-            // We need to read more data
-            //
-            off_t willread = input_file_length - input_bytes_queued;
-            off_t maxread  = queue_size - queue_bytes_available;
-            if(willread > maxread)
+            p++;
+            if(json_string(&p, found ? value : NULL, found ? size : 0)) { return 0; }
+            if(found) { return 1; }
+        }
+        else
+        {
+            for(; *p && *p != ',' && *p != '}' && *p != ' '; p++)
             {
-                DPRINTF("Will read maximum.\n");
-                willread = maxread;
+                if(found && n + 1 < size) { value[n++] = *p; }
+            }
+            if(found)
+            {
+                value[n] = 0;
+                return 1;
             }
+        }
+    }
+}
 
-            if(queue_start_ofs > 0)
+static void server_client_release(server_client *client)
+{
+    int8_t last;
+    pthread_mutex_lock(&client->lock);
+    last = --client->refs == 0;
+    pthread_mutex_unlock(&client->lock);
+    if(last)
+    {
+        close(client->fd);
+        pthread_mutex_destroy(&client->lock);
+        free(client);
+    }
+}
+
+//
+// Send a line to the client of req, if it has one, as
+// {"id":..., "status":status, extra}
+//
+static void server_reply(server_request *req, const char *status, const char *extra)
+{
+    server_client *client = req->client;
+    char           id[6 * sizeof(req->id) + 3];
+    char          *line;
+    int            len;
+    size_t         sent = 0;
+
+    if(!client) { return; }
+    json_quote(id, sizeof(id), req->id);
+    len = snprintf(NULL, 0, "{\"id\":%s,\"status\":\"%s\"%s}\n", id, status, extra ? extra : "");
+    if(len < 0 || !(line = malloc((size_t)len + 1))) { return; }
+    snprintf(line, (size_t)len + 1, "{\"id\":%s,\"status\":\"%s\"%s}\n", id, status, extra ? extra : "");
+
+    pthread_mutex_lock(&client->lock);
+    while(!client->closed && sent < (size_t)len)
+    {
+        ssize_t n = send(client->fd, line + sent, (size_t)len - sent, MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR) { continue; }
+        if(n <= 0) { client->closed = 1; }
+        else
+        {
+            sent += (size_t)n;
+        }
+    }
+    pthread_mutex_unlock(&client->lock);
+    free(line);
+}
+
+static void server_event(void *ctx, const uint8_t *sector, const char *text)
+{
+    char quoted[6 * 256 + 3];
+    char extra[sizeof(quoted) + 64];
+    json_quote(quoted, sizeof(quoted), text);
+    snprintf(extra,
+             sizeof(extra),
+             ",\"lba\":%d,\"address\":\"%02X:%02X:%02X\",\"event\":%s",
+             sector_lba(sector),
+             sector[0x00C],
+             sector[0x00D],
+             sector[0x00E],
+             quoted);
+    server_reply(ctx, "event", extra);
+}
+
+//
+// Send the final line of a request, and add it to the --json file
+//
+static void server_result(server_request *req, const char *status, const char *extra)
+{
+    char path[6 * sizeof(req->path) + 3];
+    char id[6 * sizeof(req->id) + 3];
+
+    server_reply(req, status, extra);
+    if(!opt_json) { return; }
+    json_quote(path, sizeof(path), req->path);
+    json_quote(id, sizeof(id), req->id);
+    // Under the output lock, as the file is closed under it when the server stops
+    output_begin();
+    if(json_sink)
+    {
+        fprintf(json_sink, "{\"path\":%s,\"id\":%s,\"status\":\"%s\"%s}\n", path, id, status, extra ? extra : "");
+        fflush(json_sink);
+    }
+    output_end();
+}
+
+static void server_request_free(server_request *req)
+{
+    if(req->client) { server_client_release(req->client); }
+    free(req);
+}
+
+//
+// Check the image of a request on the calling worker thread
+//
+static void server_check(server_request *req)
+{
+    char    extra[4096];
+    size_t  n = 0;
+    int8_t  failed;
+
+    server_reply(req, "checking", NULL);
+    job_name      = req->path;
+    job_cancel    = &req->cancelled;
+    job_event     = req->client ? server_event : NULL;
+    job_event_ctx = req;
+    opt_level     = req->level;
+
+    failed = ecmify(req->path);
+
+    job_name      = NULL;
+    job_cancel    = NULL;
+    job_event     = NULL;
+    job_event_ctx = NULL;
+
+    if(req->cancelled) { server_result(req, "cancelled", NULL); }
+    else if(failed) { server_result(req, "failed", ",\"error\":\"Could not check the image, see the server log\""); }
+    else
+    {
+        n += snprintf(extra + n,
+                      sizeof(extra) - n,
+                      ",\"sectors\":%u,\"errors\":%u,\"warnings\":%u,\"counters\":{",
+                      totalsectors,
+                      totalerrors,
+                      totalwarnings);
+#define CD_COUNTER_JSON(name)                                                                                        \
+    n += snprintf(extra + n, sizeof(extra) - n, "%s\"" #name "\":%u", CD_COUNTER_##name ? "," : "", name);
+        CD_COUNTERS(CD_COUNTER_JSON)
+#undef CD_COUNTER_JSON
+        snprintf(extra + n, sizeof(extra) - n, "}");
+        server_result(req, "done", extra);
+    }
+    output_begin();
+    if(csv_file) { fflush(csv_file); }
+    output_end();
+}
+
+static void *server_worker(void *arg)
+{
+    size_t slot = (size_t)(uintptr_t)arg;
+    server_block_signals();
+    pthread_mutex_lock(&server.lock);
+    for(;;)
+    {
+        server_request *req;
+        while(!server.head)
+        {
+            if(server.stopping)
             {
-                memmove(queue, queue + queue_start_ofs, queue_bytes_available);
-                queue_start_ofs = 0;
+                pthread_mutex_unlock(&server.lock);
+                return NULL;
             }
-            if(willread)
+            pthread_cond_wait(&server.wake, &server.lock);
+        }
+        req         = server.head;
+        server.head = req->next;
+        if(!server.head) { server.tail = NULL; }
+        server.queued--;
+        server.running[slot] = req;
+        pthread_cond_signal(&server.space);
+        pthread_mutex_unlock(&server.lock);
+
+        if(req->cancelled) { server_result(req, "cancelled", NULL); }
+        else
+        {
+            server_check(req);
+        }
+
+        pthread_mutex_lock(&server.lock);
+        server.running[slot] = NULL;
+        pthread_mutex_unlock(&server.lock);
+        server_request_free(req);
+        pthread_mutex_lock(&server.lock);
+    }
+    return NULL;
+}
+
+//
+// Cancel the requests with the given id (NULL: all) of a client
+//
+static void server_cancel(server_client *client, const char *id)
+{
+    server_request *req;
+    size_t          i;
+    pthread_mutex_lock(&server.lock);
+    for(req = server.head; req; req = req->next)
+    {
+        if(req->client == client && (!id || !strcmp(req->id, id))) { req->cancelled = 1; }
+    }
+    for(i = 0; i < server.nrunning; i++)
+    {
+        req = server.running[i];
+        if(req && req->client == client && (!id || !strcmp(req->id, id))) { req->cancelled = 1; }
+    }
+    pthread_mutex_unlock(&server.lock);
+}
+
+//
+// Cancel every queued and running request, then wait for the workers to
+// finish them, so nothing writes to the report, CSV or --json files after
+//
+static void server_stop(pthread_t *workers, size_t count)
+{
+    server_request *req;
+    size_t          i;
+
+    pthread_mutex_lock(&server.lock);
+    server.stopping = 1;
+    for(req = server.head; req; req = req->next) { req->cancelled = 1; }
+    for(i = 0; i < server.nrunning; i++)
+    {
+        if(server.running[i]) { server.running[i]->cancelled = 1; }
+    }
+    pthread_cond_broadcast(&server.wake);
+    pthread_cond_broadcast(&server.space);
+    pthread_mutex_unlock(&server.lock);
+    for(i = 0; i < count; i++) { pthread_join(workers[i], NULL); }
+
+    output_begin();
+    if(json_sink) { fclose(json_sink); }
+    json_sink = NULL;
+    output_end();
+}
+
+//
+// Queue a request, waiting for room in the queue if wait is set
+// Returns 1 if the queue is full, 2 if the server is stopping
+//
+static int8_t server_enqueue(server_request *req, int8_t wait)
+{
+    pthread_mutex_lock(&server.lock);
+    while(!server.stopping && server.queued >= opt_max_queue)
+    {
+        if(!wait)
+        {
+            pthread_mutex_unlock(&server.lock);
+            return 1;
+        }
+        pthread_cond_wait(&server.space, &server.lock);
+    }
+    if(server.stopping)
+    {
+        pthread_mutex_unlock(&server.lock);
+        return 2;
+    }
+    // Reply before queueing, a worker may finish it at once
+    server_reply(req, "queued", NULL);
+    if(server.tail) { server.tail->next = req; }
+    else
+    {
+        server.head = req;
+    }
+    server.tail = req;
+    server.queued++;
+    pthread_cond_signal(&server.wake);
+    pthread_mutex_unlock(&server.lock);
+    return 0;
+}
+
+//
+// Handle one request line
+//
+static void server_request_line(server_client *client, const char *line)
+{
+    server_request *req;
+    char            level[32];
+    char            cancel[128];
+
+    if(json_field(line, "cancel", cancel, sizeof(cancel)))
+    {
+        server_cancel(client, cancel);
+        return;
+    }
+
+    req = calloc(1, sizeof(server_request));
+    if(!req) { return; }
+    req->client = client;
+    req->level  = opt_cli_level;
+    pthread_mutex_lock(&client->lock);
+    client->refs++;
+    pthread_mutex_unlock(&client->lock);
+
+    json_field(line, "id", req->id, sizeof(req->id));
+    if(!json_field(line, "path", req->path, sizeof(req->path)) || !req->path[0])
+    {
+        server_result(req, "rejected", ",\"error\":\"No path\"");
+        server_request_free(req);
+        return;
+    }
+    if(json_field(line, "level", level, sizeof(level)))
+    {
+        if(!strcmp(level, "edc")) { req->level = LEVEL_EDC; }
+        else if(!strcmp(level, "full")) { req->level = LEVEL_FULL; }
+        else if(!strcmp(level, "paranoid")) { req->level = LEVEL_PARANOID; }
+        else
+        {
+            server_result(req, "rejected", ",\"error\":\"Unknown level\"");
+            server_request_free(req);
+            return;
+        }
+    }
+    if(access(req->path, R_OK) != 0)
+    {
+        char quoted[6 * 256 + 3];
+        char error[sizeof(quoted) + 16];
+        json_quote(quoted, sizeof(quoted), strerror(errno));
+        snprintf(error, sizeof(error), ",\"error\":%s", quoted);
+        server_result(req, "failed", error);
+        server_request_free(req);
+        return;
+    }
+
+    switch(server_enqueue(req, 0))
+    {
+    case 1:
+        server_result(req, "rejected", ",\"error\":\"Queue full\"");
+        server_request_free(req);
+        break;
+    case 2:
+        server_result(req, "rejected", ",\"error\":\"Server stopping\"");
+        server_request_free(req);
+        break;
+    }
+}
+
+static void *server_connection(void *arg)
+{
+    server_client *client = arg;
+    char          *buffer = malloc(SERVER_LINE_MAX);
+    size_t         used   = 0;
+
+    server_block_signals();
+    while(buffer)
+    {
+        char   *end;
+        ssize_t n = recv(client->fd, buffer + used, SERVER_LINE_MAX - 1 - used, 0);
+        if(n < 0 && errno == EINTR) { continue; }
+        if(n <= 0) { break; }
+        used += (size_t)n;
+        buffer[used] = 0;
+        while((end = memchr(buffer, '\n', used)) != NULL)
+        {
+            *end = 0;
+            if(end > buffer) { server_request_line(client, buffer); }
+            used -= (size_t)(end + 1 - buffer);
+            memmove(buffer, end + 1, used);
+        }
+        // A line that doesn't fit is not a request
+        if(used == SERVER_LINE_MAX - 1) { break; }
+    }
+    free(buffer);
+
+    pthread_mutex_lock(&client->lock);
+    client->closed = 1;
+    pthread_mutex_unlock(&client->lock);
+    server_cancel(client, NULL);
+    server_client_release(client);
+    return NULL;
+}
+
+#ifdef HAVE_WATCH
+//
+// Queue the file name of the watched folder, unless it is something
+// edccchk writes next to images
+// Returns nonzero if the server is stopping
+//
+static int8_t server_watch_file(const char *name)
+{
+    server_request *req;
+    size_t          len = strlen(name);
+
+    if(name[0] == '.' || (len > 8 && !strcmp(name + len - 8, ".edccidx")) ||
+       (len > 4 && !strcmp(name + len - 4, ".tmp")))
+    { return 0; }
+
+    req = calloc(1, sizeof(server_request));
+    if(!req) { return 0; }
+    snprintf(req->id, sizeof(req->id), "%.127s", name);
+    snprintf(req->path, sizeof(req->path), "%s/%s", opt_watch, name);
+    req->level = opt_cli_level;
+    if(server_enqueue(req, 1))
+    {
+        server_request_free(req);
+        return 1;
+    }
+    return 0;
+}
+
+//
+// Queue every file of the watched folder, when inotify lost events
+// Returns nonzero if the server is stopping
+//
+static int8_t server_watch_rescan(void)
+{
+    DIR           *dir;
+    struct dirent *entry;
+    int8_t         stopping = 0;
+
+    output_begin();
+    printf("Events of %s were lost, checking all its files again\n", opt_watch);
+    fflush(stdout);
+    output_end();
+    dir = opendir(opt_watch);
+    if(!dir)
+    {
+        printfileerror(NULL, opt_watch);
+        return 0;
+    }
+    while(!stopping && (entry = readdir(dir)) != NULL)
+    {
+        if(entry->d_type != DT_REG && entry->d_type != DT_UNKNOWN) { continue; }
+        stopping = server_watch_file(entry->d_name);
+    }
+    closedir(dir);
+    return stopping;
+}
+
+//
+// Queue the files closed after writing or moved into the watched folder
+//
+static void *server_watch(void *arg)
+{
+    int   fd = *(int *)arg;
+    char *buffer;
+
+    server_block_signals();
+    buffer = malloc(65536);
+    while(buffer)
+    {
+        struct pollfd fds[2] = {{server_wakefd[0], POLLIN, 0}, {fd, POLLIN, 0}};
+        ssize_t       n;
+        ssize_t       i;
+
+        if(poll(fds, 2, -1) < 0)
+        {
+            if(errno == EINTR) { continue; }
+            break;
+        }
+        if(fds[0].revents) { break; }
+        n = read(fd, buffer, 65536);
+        if(n < 0 && errno == EINTR) { continue; }
+        if(n <= 0) { break; }
+        for(i = 0; i < n; i += sizeof(struct inotify_event) + ((struct inotify_event *)(buffer + i))->len)
+        {
+            const struct inotify_event *event    = (const struct inotify_event *)(buffer + i);
+            int8_t                      stopping = 0;
+
+            if(event->mask & IN_Q_OVERFLOW) { stopping = server_watch_rescan(); }
+            else if(event->len && !(event->mask & IN_ISDIR)) { stopping = server_watch_file(event->name); }
+            if(stopping)
             {
-                setcounter_analyze(input_bytes_queued);
+                free(buffer);
+                return NULL;
+            }
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+#endif
 
-                if(fseeko(in, input_bytes_queued, SEEK_SET) != 0) { goto error_in; }
-                if(fread(queue + queue_bytes_available, 1, willread, in) != (size_t)willread) { goto error_in; }
+//
+// Serve on the Unix socket at path, if any, and the watched folder, if
+// any, until interrupted
+// Returns nonzero on error
+//
+static int8_t server_run(const char *path)
+{
+    struct sockaddr_un addr;
+    struct sigaction   action;
+    int                fd         = -1;
+    int                watchfd    = -1;
+    const char        *errorname  = path;
+    pthread_t         *workers    = NULL;
+    size_t             nworkers   = 0;
+    int8_t             returncode = 1;
+    size_t             i;
+#ifdef HAVE_WATCH
+    pthread_t watcher;
+    int8_t    watching = 0;
+#endif
 
-                input_edc = edc_compute(input_edc, queue + queue_bytes_available, willread);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(path && strlen(path) >= sizeof(addr.sun_path))
+    {
+        printf("Socket path too long: %s\n", path);
+        return 1;
+    }
+    if(path) { strcpy(addr.sun_path, path); }
 
-                input_bytes_queued += willread;
-                queue_bytes_available += willread;
-            }
-        }
+    server.nrunning = opt_threads;
+    server.running  = calloc(opt_threads, sizeof(server_request *));
+    workers         = calloc(opt_threads, sizeof(pthread_t));
+    if(!server.running || !workers)
+    {
+        printf("Out of memory\n");
+        free(workers);
+        return 1;
+    }
 
-        if(queue_bytes_available == 0)
+    if(opt_json)
+    {
+        json_sink = fopen(opt_json, "a");
+        if(!json_sink)
         {
-            DPRINTF("ecmify(): No data left in queue.\n");
-            //
-            // No data left to read -> quit
-            //
-            break;
+            errorname = opt_json;
+            goto error;
         }
+    }
 
-        uint8_t *sector = queue + queue_start_ofs;
-
-        // Data sector
-        if(sector[0x000] == 0x00 && // sync (12 bytes)
-           sector[0x001] == 0xFF && sector[0x002] == 0xFF && sector[0x003] == 0xFF && sector[0x004] == 0xFF &&
-           sector[0x005] == 0xFF && sector[0x006] == 0xFF && sector[0x007] == 0xFF && sector[0x008] == 0xFF &&
-           sector[0x009] == 0xFF && sector[0x00A] == 0xFF && sector[0x00B] == 0x00)
-        {
-            DPRINTF("ecmify(): Data sector, address %02X:%02X:%02X.\n", sector[0x00C], sector[0x00D], sector[0x00E]);
-            // Just for debug
-            //            fprintf(stderr, "Address: %02X:%02X:%02X\n", sector[0x00C], sector[0x00D], sector[0x00E]);
-            if(sector[0x00F] == 0x00) // mode (1 byte)
-            {
-                DPRINTF("ecmify(): Mode 0 sector at address %02X:%02X:%02X.\n",
-                        sector[0x00C],
-                        sector[0x00D],
-                        sector[0x00E]);
-                mode0sectors++;
-                for(int i = 0x010; i < 0x930; i++)
-                {
-                    if(sector[i] != 0x00)
-                    {
-                        mode0errors++;
-                        totalerrors++;
-                        fprintf(stderr,
-                                "Mode 0 sector with error at address: %02X:%02X:%02X (LBA: %d / File Address: %06X)\n",
-							sector[0x00C],
-							sector[0x00D],
-							sector[0x00E],
-							(((((sector[0x00C] >> 4) * 10) + (sector[0x00C] & 0x0F)) * 60) + (((sector[0x00D] >> 4) * 10) + (sector[0x00D] & 0x0F)) - 2) * 75 + (((sector[0x00E] >> 4) * 10) + (sector[0x00E] & 0x0F)),
-							((((((sector[0x00C] >> 4) * 10) + (sector[0x00C] & 0x0F)) * 60) + (((sector[0x00D] >> 4) * 10) + (sector[0x00D] & 0x0F)) - 2) * 75 + (((sector[0x00E] >> 4) * 10) + (sector[0x00E] & 0x0F))) * 2352);
-                        break;
-                    }
-                }
-            }
-            else if(sector[0x00F] == 0x01) // mode (1 byte)
-            {
-                DPRINTF("ecmify(): Mode 1 sector at address %02X:%02X:%02X.\n",
-                        sector[0x00C],
-                        sector[0x00D],
-                        sector[0x00E]);
-                mode1sectors++;
-                if(!ecc_checksector(sector + 0xC, sector + 0x10, sector + 0x81C) ||
-                   edc_compute(0, sector, 0x810) != get32lsb(sector + 0x810) ||
-                   sector[0x814] != 0x00 || // reserved (8 bytes)
-                   sector[0x815] != 0x00 || sector[0x816] != 0x00 || sector[0x817] != 0x00 || sector[0x818] != 0x00 ||
-                   sector[0x819] != 0x00 || sector[0x81A] != 0x00 || sector[0x81B] != 0x00)
-                {
-                    mode1errors++;
-                    totalerrors++;
-					fprintf(stderr,
-							"Mode 1 sector with error at address: %02X:%02X:%02X (LBA: %d / File Address: %06X)\n",
-							sector[0x00C],
-							sector[0x00D],
-							sector[0x00E],
-							(((((sector[0x00C] >> 4) * 10) + (sector[0x00C] & 0x0F)) * 60) + (((sector[0x00D] >> 4) * 10) + (sector[0x00D] & 0x0F)) - 2) * 75 + (((sector[0x00E] >> 4) * 10) + (sector[0x00E] & 0x0F)),
-							((((((sector[0x00C] >> 4) * 10) + (sector[0x00C] & 0x0F)) * 60) + (((sector[0x00D] >> 4) * 10) + (sector[0x00D] & 0x0F)) - 2) * 75 + (((sector[0x00E] >> 4) * 10) + (sector[0x00E] & 0x0F))) * 2352);
-
-                    if(edc_compute(0, sector, 0x810) != get32lsb(sector + 0x810))
-                        fprintf(stderr, "%02X:%02X:%02X: Failed EDC\n", sector[0x00C], sector[0x00D], sector[0x00E]);
-						total_edc_err++;
-						mode1_edc_err++;
-                    if(!ecc_checkpq(sector + 0xC, sector + 0x10, 86, 24, 2, 86, sector + 0x81C))
-                        fprintf(stderr, "%02X:%02X:%02X: Failed ECC P\n", sector[0x00C], sector[0x00D], sector[0x00E]);
-						total_ecc_p_err++;
-						mode1_ecc_p_err++;
-                    if(!ecc_checkpq(sector + 0xC, sector + 0x10, 52, 43, 86, 88, sector + 0x81C + 0xAC))
-                        fprintf(stderr, "%02X:%02X:%02X: Failed ECC Q\n", sector[0x00C], sector[0x00D], sector[0x00E]);
-						total_ecc_q_err++;
-						mode1_ecc_q_err++;
-                }
+    if(path)
+    {
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(fd < 0) { goto error; }
 
-                filled = 1;
-                for(int i = 0x010; i < 0x810; i++)
-                {
-                    if(sector[i] != 0x55)
-                    {
-                        filled = 0;
-                        break;
-                    }
-                }
+        // Take over the socket of a server that is gone, but not of one that is running
+        if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+        {
+            printf("A server is already listening on %s\n", path);
+            close(fd);
+            fd = -1;
+            goto done;
+        }
+        unlink(path);
+        if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) { goto error; }
+    }
 
-                if(filled)
-                {
-                    filledsectors++;
-                    fprintf(stderr,
-                            "Mode 1 sector at address: %02X:%02X:%02X (LBA: %d / File Address: %06X) is filled with 55h\n",
-							sector[0x00C],
-							sector[0x00D],
-							sector[0x00E],
-							(((((sector[0x00C] >> 4) * 10) + (sector[0x00C] & 0x0F)) * 60) + (((sector[0x00D] >> 4) * 10) + (sector[0x00D] & 0x0F)) - 2) * 75 + (((sector[0x00E] >> 4) * 10) + (sector[0x00E] & 0x0F)),
-							((((((sector[0x00C] >> 4) * 10) + (sector[0x00C] & 0x0F)) * 60) + (((sector[0x00D] >> 4) * 10) + (sector[0x00D] & 0x0F)) - 2) * 75 + (((sector[0x00E] >> 4) * 10) + (sector[0x00E] & 0x0F))) * 2352);
-                }
-            }
-            else if(sector[0x00F] == 0x02) // mode (1 byte)
-            {
-                DPRINTF("ecmify(): Mode 2 sector at address %02X:%02X:%02X.\n",
-                        sector[0x00C],
-                        sector[0x00D],
-                        sector[0x00E]);
-                uint8_t *m2sec = sector + 0x10;
+    if(pipe(server_wakefd) != 0) { goto error; }
+    fcntl(server_wakefd[1], F_SETFL, O_NONBLOCK);
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = server_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
 
-                if((sector[0x012] & 0x20) == 0x20) // mode 2 form 2
-                {
-                    mode2f2sectors++;
-                    if(edc_compute(0, m2sec, 0x91C) != get32lsb(m2sec + 0x91C) && get32lsb(m2sec + 0x91C) != 0)
-                    {
-                        fprintf(stderr,
-                                "Mode 2 form 2 sector with error at address: %02X:%02X:%02X (LBA: %d / File Address: %06X)\n",
-								sector[0x00C],
-								sector[0x00D],
-								sector[0x00E],
-								(((((sector[0x00C] >> 4) * 10) + (sector[0x00C] & 0x0F)) * 60) + (((sector[0x00D] >> 4) * 10) + (sector[0x00D] & 0x0F)) - 2) * 75 + (((sector[0x00E] >> 4) * 10) + (sector[0x00E] & 0x0F)),
-								((((((sector[0x00C] >> 4) * 10) + (sector[0x00C] & 0x0F)) * 60) + (((sector[0x00D] >> 4) * 10) + (sector[0x00D] & 0x0F)) - 2) * 75 + (((sector[0x00E] >> 4) * 10) + (sector[0x00E] & 0x0F))) * 2352);
-                        if(edc_compute(0, m2sec, 0x91C) != get32lsb(m2sec + 0x91C))
-                            fprintf(
-                                stderr, "%02X:%02X:%02X: Failed EDC\n", sector[0x00C], sector[0x00D], sector[0x00E]);
-							total_edc_err++;
-							mode2f2_edc_err++;
-                        mode2f2errors++;
-                        totalerrors++;
-                    }
-                    if(sector[0x010] != sector[0x014] || sector[0x011] != sector[0x015] ||
-                       sector[0x012] != sector[0x016] || sector[0x013] != sector[0x017])
-                    {
-                        mode2f2warnings++;
-                        totalwarnings++;
-                        fprintf(stderr,
-                                "Subheader copies differ in mode 2 form 2 sector at address: %02X:%02X:%02X (LBA: %d / File Address: %06X)\n",
-								sector[0x00C],
-								sector[0x00D],
-								sector[0x00E],
-								(((((sector[0x00C] >> 4) * 10) + (sector[0x00C] & 0x0F)) * 60) + (((sector[0x00D] >> 4) * 10) + (sector[0x00D] & 0x0F)) - 2) * 75 + (((sector[0x00E] >> 4) * 10) + (sector[0x00E] & 0x0F)),
-								((((((sector[0x00C] >> 4) * 10) + (sector[0x00C] & 0x0F)) * 60) + (((sector[0x00D] >> 4) * 10) + (sector[0x00D] & 0x0F)) - 2) * 75 + (((sector[0x00E] >> 4) * 10) + (sector[0x00E] & 0x0F))) * 2352);
-                    }
+    // Joined when the server stops, so none outlives the output files
+    for(i = 0; i < opt_threads; i++)
+    {
+        if(pthread_create(&workers[i], NULL, server_worker, (void *)(uintptr_t)i) != 0) { goto error; }
+        numa_bind(workers[i], i);
+        nworkers++;
+    }
 
-                    filled = 1;
-                    for(int i = 0x018; i < 0x91C; i++)
-                    {
-                        if(sector[i] != 0x55)
-                        {
-                            filled = 0;
-                            break;
-                        }
-                    }
+#ifdef HAVE_WATCH
+    if(opt_watch)
+    {
+        errorname = opt_watch;
+        watchfd   = inotify_init();
+        if(watchfd < 0 || inotify_add_watch(watchfd, opt_watch, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) { goto error; }
+        if(pthread_create(&watcher, NULL, server_watch, &watchfd) != 0) { goto error; }
+        watching = 1;
+        printf("Watching %s\n", opt_watch);
+    }
+#endif
 
-                    if(filled)
-                    {
-                        filledsectors++;
-                        fprintf(stderr,
-                                "Mode 2 form 2 sector at address: %02X:%02X:%02X (LBA: %d / File Address: %06X) is filled with 55h\n",
-								sector[0x00C],
-								sector[0x00D],
-								sector[0x00E],
-								(((((sector[0x00C] >> 4) * 10) + (sector[0x00C] & 0x0F)) * 60) + (((sector[0x00D] >> 4) * 10) + (sector[0x00D] & 0x0F)) - 2) * 75 + (((sector[0x00E] >> 4) * 10) + (sector[0x00E] & 0x0F)),
-								((((((sector[0x00C] >> 4) * 10) + (sector[0x00C] & 0x0F)) * 60) + (((sector[0x00D] >> 4) * 10) + (sector[0x00D] & 0x0F)) - 2) * 75 + (((sector[0x00E] >> 4) * 10) + (sector[0x00E] & 0x0F))) * 2352);
-                    }
-                }
-                else
-                {
-                    mode2f1sectors++;
-                    if(!ecc_checksector(zeroaddress, m2sec, m2sec + 0x80C) ||
-                       edc_compute(0, m2sec, 0x808) != get32lsb(m2sec + 0x808))
-                    {
-                        fprintf(stderr,
-                                "Mode 2 form 1 sector with error at address: %02X:%02X:%02X (LBA: %d / File Address: %06X)\n",
-								sector[0x00C],
-								sector[0x00D],
-								sector[0x00E],
-								(((((sector[0x00C] >> 4) * 10) + (sector[0x00C] & 0x0F)) * 60) + (((sector[0x00D] >> 4) * 10) + (sector[0x00D] & 0x0F)) - 2) * 75 + (((sector[0x00E] >> 4) * 10) + (sector[0x00E] & 0x0F)),
-								((((((sector[0x00C] >> 4) * 10) + (sector[0x00C] & 0x0F)) * 60) + (((sector[0x00D] >> 4) * 10) + (sector[0x00D] & 0x0F)) - 2) * 75 + (((sector[0x00E] >> 4) * 10) + (sector[0x00E] & 0x0F))) * 2352);        
-                        if(edc_compute(0, m2sec, 0x808) != get32lsb(m2sec + 0x808))
-                            fprintf(
-                                stderr, "%02X:%02X:%02X: Failed EDC\n", sector[0x00C], sector[0x00D], sector[0x00E]);
-							total_edc_err++;
-							mode2f1_edc_err++;
-                        if(!ecc_checkpq(zeroaddress, m2sec, 86, 24, 2, 86, m2sec + 0x80C))
-                            fprintf(
-                                stderr, "%02X:%02X:%02X: Failed ECC P\n", sector[0x00C], sector[0x00D], sector[0x00E]);
-							total_ecc_p_err++;
-							mode2f1_ecc_p_err++;
-                        if(!ecc_checkpq(zeroaddress, m2sec, 52, 43, 86, 88, m2sec + 0x80C))
-                            fprintf(
-                                stderr, "%02X:%02X:%02X: Failed ECC Q\n", sector[0x00C], sector[0x00D], sector[0x00E]);
-							total_ecc_q_err++;
-							mode2f1_ecc_q_err++;
-                        mode2f1errors++;
-                        totalerrors++;
-                    }
-                    if(sector[0x010] != sector[0x014] || sector[0x011] != sector[0x015] ||
-                       sector[0x012] != sector[0x016] || sector[0x013] != sector[0x017])
-                    {
-                        mode2f1warnings++;
-                        totalwarnings++;
-                        fprintf(stderr,
-                                "Subheader copies differ in mode 2 form 1 sector at address: %02X:%02X:%02X (LBA: %d / File Address: %06X)\n",
-								sector[0x00C],
-								sector[0x00D],
-								sector[0x00E],
-								(((((sector[0x00C] >> 4) * 10) + (sector[0x00C] & 0x0F)) * 60) + (((sector[0x00D] >> 4) * 10) + (sector[0x00D] & 0x0F)) - 2) * 75 + (((sector[0x00E] >> 4) * 10) + (sector[0x00E] & 0x0F)),
-								((((((sector[0x00C] >> 4) * 10) + (sector[0x00C] & 0x0F)) * 60) + (((sector[0x00D] >> 4) * 10) + (sector[0x00D] & 0x0F)) - 2) * 75 + (((sector[0x00E] >> 4) * 10) + (sector[0x00E] & 0x0F))) * 2352);
-                    }
+    if(path) { printf("Serving on %s with %u threads\n", path, (unsigned)opt_threads); }
+    fflush(stdout);
 
-                    filled = 1;
-                    for(int i = 0x018; i < 0x818; i++)
-                    {
-                        if(sector[i] != 0x55)
-                        {
-                            filled = 0;
-                            break;
-                        }
-                    }
+    while(!server_quit)
+    {
+        struct pollfd  fds[2] = {{server_wakefd[0], POLLIN, 0}, {fd, POLLIN, 0}};
+        server_client *client;
+        pthread_t      thread;
+        int            cfd;
 
-                    if(filled)
-                    {
-                        filledsectors++;
-                        fprintf(stderr,
-                                "Mode 2 form 1 sector at address: %02X:%02X:%02X (LBA: %d / File Address: %06X) is filled with 55h\n",
-								sector[0x00C],
-								sector[0x00D],
-								sector[0x00E],
-								(((((sector[0x00C] >> 4) * 10) + (sector[0x00C] & 0x0F)) * 60) + (((sector[0x00D] >> 4) * 10) + (sector[0x00D] & 0x0F)) - 2) * 75 + (((sector[0x00E] >> 4) * 10) + (sector[0x00E] & 0x0F)),
-								((((((sector[0x00C] >> 4) * 10) + (sector[0x00C] & 0x0F)) * 60) + (((sector[0x00D] >> 4) * 10) + (sector[0x00D] & 0x0F)) - 2) * 75 + (((sector[0x00E] >> 4) * 10) + (sector[0x00E] & 0x0F))) * 2352);
-                    }
-                }
-            }
-            else // Unknown sector mode!!!
-            {
-                DPRINTF("ecmify(): Unknown data sector with mode %d at address %02X:%02X:%02X.\n",
-                        sector[0x00F],
-                        sector[0x00C],
-                        sector[0x00D],
-                        sector[0x00E]);
-                nondatasectors++;
-            }
+        // A signal arriving before the poll leaves the pipe readable, so it isn't lost
+        if(poll(fds, fd >= 0 ? 2 : 1, -1) < 0)
+        {
+            if(errno == EINTR) { continue; }
+            goto error;
         }
-        else // Non data sector
+        if(fds[0].revents) { break; }
+        cfd = accept(fd, NULL, NULL);
+        if(cfd < 0)
         {
-            DPRINTF("ecmify(): Non-data sector.\n");
-            nondatasectors++;
+            if(errno == EINTR || errno == ECONNABORTED) { continue; }
+            goto error;
         }
-
-        //
-        // Advance to the next sector
-        //
-        totalsectors++;
-        input_bytes_checked += 2352;
-        queue_start_ofs += 2352;
-        queue_bytes_available -= 2352;
-
-        DPRINTF("ecmify.totalsectors = %d\n", totalsectors);
-        DPRINTF("ecmify.input_bytes_checked = %d\n", input_bytes_checked);
-        DPRINTF("ecmify.queue_start_ofs = %d\n", queue_start_ofs);
-        DPRINTF("ecmify.queue_bytes_available = %d\n", queue_bytes_available);
+        client = calloc(1, sizeof(server_client));
+        if(!client)
+        {
+            close(cfd);
+            continue;
+        }
+        client->fd   = cfd;
+        client->refs = 1;
+        pthread_mutex_init(&client->lock, NULL);
+        if(pthread_create(&thread, NULL, server_connection, client) != 0)
+        {
+            server_client_release(client);
+            continue;
+        }
+        pthread_detach(thread);
     }
 
-    //
-    // Show report
-    //
-	printf("\n-------------------Report:--------------------\n");
-    printf("Non-data sectors........ %d\n", nondatasectors);
-    printf("Mode 0 sectors.......... %d\n", mode0sectors);
-    printf("\twith errors........... %d\n", mode0errors);
-    printf("Mode 1 sectors.......... %d\n", mode1sectors);
-	printf("\twith ECC P errors..... %d\n", mode1_ecc_p_err);
-	printf("\twith ECC Q errors..... %d\n", mode1_ecc_q_err);
-	printf("\twith EDC errors....... %d\n", mode1_edc_err);	
-    printf("\twith errors........... %d\n", mode1errors);
-    printf("Mode 2 form 1 sectors... %d\n", mode2f1sectors);
-	printf("\twith ECC P errors..... %d\n", mode2f1_ecc_p_err);
-	printf("\twith ECC Q errors..... %d\n", mode2f1_ecc_q_err);
-	printf("\twith EDC errors....... %d\n", mode2f1_edc_err);	
-    printf("\twith errors........... %d\n", mode2f1errors);
-    printf("\twith warnings......... %d\n", mode2f1warnings);
-    printf("Mode 2 form 2 sectors... %d\n", mode2f2sectors);
-	printf("\twith EDC errors....... %d\n", mode2f2_edc_err);	
-    printf("\twith errors........... %d\n", mode2f2errors);
-    printf("\twith warnings......... %d\n", mode2f2warnings);
-    printf("Filled sectors.......... %d\n", filledsectors);
-    printf("Total sectors........... %d\n", totalsectors);
-    printf("Total errors............ %d\n", totalerrors);
-	printf("\twith ECC P errors..... %d\n", total_ecc_p_err);	
-    printf("\twith ECC Q errors..... %d\n", total_ecc_q_err);
-    printf("\twith EDC errors....... %d\n", total_edc_err);
-    printf("Total warnings.......... %d\n", totalwarnings);
-    printf("Total errors+warnings... %d\n", totalerrors + totalwarnings);
-	printf("----------------------------------------------\n");
-	
-    write_csv_row(infilename, nondatasectors, mode0sectors, mode0errors,
-                  mode1sectors, mode1errors,
-                  mode2f1sectors, mode2f1errors, mode2f1warnings,
-                  mode2f2sectors, mode2f2errors, mode2f2warnings,
-                  filledsectors, totalsectors,
-                  totalerrors, totalwarnings,
-				  mode1_ecc_p_err, mode1_ecc_q_err, mode1_edc_err,
-				  mode2f1_ecc_p_err, mode2f1_ecc_q_err, mode2f1_edc_err,
-				  mode2f2_edc_err,
-				  total_ecc_p_err, total_ecc_q_err, total_edc_err);
-				  
-    //
-    // Success
-    //
-    printf("Done\n");
+    printf("Stopping\n");
+    if(fd >= 0) { unlink(path); }
     returncode = 0;
     goto done;
 
-error_in:
-    printfileerror(in, infilename);
-    goto error;
-
 error:
-    returncode = 1;
-    goto done;
-
+    printfileerror(NULL, errorname);
 done:
-    if(queue != NULL) { free(queue); }
-    if(in != NULL) { fclose(in); }
-
+    server_wake();
+    server_stop(workers, nworkers);
+#ifdef HAVE_WATCH
+    if(watching) { pthread_join(watcher, NULL); }
+#endif
+    if(fd >= 0) { close(fd); }
+    if(watchfd >= 0) { close(watchfd); }
+    free(workers);
     return returncode;
 }
+#endif
 
 int main(int argc, char **argv)
 {
     DPRINTF("Entering main().\n");
-    int   returncode = 0;
-    char *infilename = NULL;
+    int      returncode  = 0;
+    char   **infilenames = NULL;
+    size_t   nfiles      = 0;
+    size_t   f;
+    int      i;
+    workpool pool;
 
     DPRINTF("Normalizing argv[0].\n");
     normalize_argv0(argv[0]);
 
+    memset(&pool, 0, sizeof(pool));
+
+    //
+    // Merge partial results
+    //
+    if(argc > 1 && !strcmp(argv[1], "merge"))
+    {
+        if(argc < 3) { goto usage; }
+        open_csv_file();
+        if(merge_partials(argc - 2, argv + 2)) { goto error; }
+        close_csv_file();
+        goto done;
+    }
 
     //
     // Check command line
     //
-    switch(argc)
+    infilenames = malloc(argc * sizeof(char *));
+    if(!infilenames)
     {
-        case 2:
-            infilename = argv[1];
-            //
-            // Initialize the ECC/EDC tables
-            //
-			open_csv_file();
-            eccedc_init();
-            if(ecmify(infilename)) 
-			{ 
-				goto error; 
-			}
-            break;
-        default: goto usage;
+        printf("Out of memory\n");
+        goto error;
+    }
+    for(i = 1; i < argc; i++)
+    {
+        const char *value;
+        if(!strcmp(argv[i], "--dvd")) { opt_dvd = 1; }
+        else if(!strcmp(argv[i], "--list-kernels")) { opt_list = 1; }
+        else if((value = option_value(argc, argv, &i, "--kernel")) != NULL) { opt_kernel = value; }
+        else if((value = option_value(argc, argv, &i, "--level")) != NULL)
+        {
+            if(!strcmp(value, "edc")) { opt_cli_level = LEVEL_EDC; }
+            else if(!strcmp(value, "full")) { opt_cli_level = LEVEL_FULL; }
+            else if(!strcmp(value, "paranoid")) { opt_cli_level = LEVEL_PARANOID; }
+            else
+            {
+                goto usage;
+            }
+            opt_level = opt_cli_level;
+        }
+        else if((value = option_value(argc, argv, &i, "--sample")) != NULL)
+        {
+            char *end;
+            opt_sample_percent = strtod(value, &end);
+            if(*end == '%') { end++; }
+            if(*end || !(opt_sample_percent > 0 && opt_sample_percent <= 100)) { goto usage; }
+        }
+        else if((value = option_value(argc, argv, &i, "--sample-sectors")) != NULL)
+        {
+            opt_sample_sectors = strtoul(value, NULL, 10);
+            if(!opt_sample_sectors) { goto usage; }
+        }
+        else if((value = option_value(argc, argv, &i, "--seed")) != NULL)
+        {
+            char *end;
+            opt_seed     = strtoull(value, &end, 10);
+            opt_seed_set = 1;
+            if(!*value || *end) { goto usage; }
+        }
+        else if((value = option_value(argc, argv, &i, "--start-lba")) != NULL)
+        {
+            opt_start_lba = strtoul(value, NULL, 10);
+        }
+        else if((value = option_value(argc, argv, &i, "--end-lba")) != NULL)
+        {
+            opt_end_lba = strtoul(value, NULL, 10);
+            if(!opt_end_lba) { goto usage; }
+        }
+        else if((value = option_value(argc, argv, &i, "--shard")) != NULL)
+        {
+            if(sscanf(value, "%u/%u", &opt_shard, &opt_shard_count) != 2 || !opt_shard ||
+               opt_shard > opt_shard_count)
+            { goto usage; }
+        }
+        else if((value = option_value(argc, argv, &i, "--partial")) != NULL) { opt_partial = value; }
+        else if(!strcmp(argv[i], "--no-numa")) { opt_numa = 0; }
+        else if(!strcmp(argv[i], "--background")) { opt_background = 1; }
+        else if((value = option_value(argc, argv, &i, "--cache")) != NULL) { opt_cache = value; }
+        else if(!strcmp(argv[i], "--index")) { opt_index = 1; }
+        else if(!strcmp(argv[i], "--dedupe")) { opt_dedupe = 1; }
+#ifdef HAVE_SERVER
+        else if((value = option_value(argc, argv, &i, "--serve")) != NULL) { opt_serve = value; }
+        else if((value = option_value(argc, argv, &i, "--json")) != NULL) { opt_json = value; }
+#ifdef HAVE_WATCH
+        else if((value = option_value(argc, argv, &i, "--watch")) != NULL) { opt_watch = value; }
+#endif
+        else if((value = option_value(argc, argv, &i, "--max-queue")) != NULL)
+        {
+            opt_max_queue = strtoul(value, NULL, 10);
+            if(!opt_max_queue) { goto usage; }
+        }
+#endif
+        else if(!strcmp(argv[i], "--compare")) { opt_compare = 1; }
+        else if((value = option_value(argc, argv, &i, "--ecm-out")) != NULL) { opt_ecm_out = value; }
+        else if((value = option_value(argc, argv, &i, "--extract-iso")) != NULL) { opt_extract_iso = value; }
+        else if((value = option_value(argc, argv, &i, "--extract-2336")) != NULL) { opt_extract_2336 = value; }
+        else if((value = option_value(argc, argv, &i, "--bad-marker")) != NULL) { opt_bad_marker = value; }
+#ifdef HAVE_REPAIR
+        else if(!strcmp(argv[i], "--repair")) { opt_repair = 1; }
+        else if(!strcmp(argv[i], "--undo")) { opt_undo = 1; }
+#endif
+        else if((value = option_value(argc, argv, &i, "--merge-out")) != NULL)
+        {
+            opt_merge_out = value;
+            opt_compare   = 1;
+        }
+        else if((value = option_value(argc, argv, &i, "--ddrescue-map")) != NULL) { opt_ddrescue_map = value; }
+        else if((value = option_value(argc, argv, &i, "--skip-map")) != NULL) { opt_skip_map = value; }
+        else if((value = option_value(argc, argv, &i, "--events-fd")) != NULL)
+        {
+            char *end;
+            opt_events_fd = (int)strtol(value, &end, 10);
+            if(*end || opt_events_fd < 0) { goto usage; }
+        }
+        else if((value = option_value(argc, argv, &i, "--readahead")) != NULL)
+        {
+            char *end;
+            opt_readahead = (off_t)(strtod(value, &end) * (1 << 20));
+            if(*end || opt_readahead < 0) { goto usage; }
+        }
+        else if((value = option_value(argc, argv, &i, "--revalidate-older-than")) != NULL)
+        {
+            char *end;
+            opt_revalidate_age = strtod(value, &end);
+            if(*end == 's') { end++; }
+            else if(*end == 'm') { opt_revalidate_age *= 60, end++; }
+            else if(*end == 'h') { opt_revalidate_age *= 3600, end++; }
+            else
+            {
+                opt_revalidate_age *= 86400;
+                if(*end == 'd') { end++; }
+            }
+            if(*end || !(opt_revalidate_age > 0)) { goto usage; }
+        }
+        else if((value = option_value(argc, argv, &i, "--max-read-rate")) != NULL)
+        {
+            opt_max_read_rate = strtod(value, NULL);
+            if(!(opt_max_read_rate > 0)) { goto usage; }
+        }
+        else if((value = option_value(argc, argv, &i, "--device-readers")) != NULL)
+        {
+            opt_device_readers = strtoul(value, NULL, 10);
+            if(!opt_device_readers) { goto usage; }
+        }
+        else if((value = option_value(argc, argv, &i, "--threads")) != NULL)
+        {
+            opt_threads = strtoul(value, NULL, 10);
+            if(!opt_threads) { goto usage; }
+        }
+        else if(argv[i][0] == '-' && argv[i][1] == '-')
+        {
+            printf("Unknown option %s\n", argv[i]);
+            goto usage;
+        }
+        else
+        {
+            infilenames[nfiles++] = argv[i];
+        }
+    }
+    if(!nfiles && !opt_list && !opt_serve && !opt_watch) { goto usage; }
+    if((opt_serve || opt_watch) && (nfiles || opt_partial))
+    {
+        printf("--serve and --watch take their images from requests, not image names or --partial\n");
+        goto usage;
+    }
+    if(opt_partial && nfiles > 1)
+    {
+        printf("--partial needs a single image\n");
+        goto usage;
+    }
+    if((opt_ddrescue_map || opt_skip_map) && nfiles != 1)
+    {
+        printf("--ddrescue-map and --skip-map need a single image\n");
+        goto usage;
+    }
+    if(opt_compare && (nfiles < 2 || nfiles > COMPARE_MAX_IMAGES))
+    {
+        printf("--compare and --merge-out need 2 to %u dumps\n", (unsigned)COMPARE_MAX_IMAGES);
+        goto usage;
+    }
+    if(opt_repair && (nfiles != 1 || !whole_image() || opt_compare || opt_dvd))
+    {
+        printf("--repair needs a single whole image\n");
+        goto usage;
+    }
+    if((opt_extract_iso || opt_extract_2336) && (nfiles != 1 || !whole_image() || opt_compare || opt_dvd))
+    {
+        printf("--extract-iso and --extract-2336 need a single whole image\n");
+        goto usage;
+    }
+    if(opt_ecm_out && (nfiles != 1 || !whole_image() || opt_compare))
+    {
+        printf("--ecm-out needs a single whole image\n");
+        goto usage;
+    }
+    if(opt_ddrescue_map && (opt_sample_percent || opt_sample_sectors))
+    {
+        printf("--ddrescue-map can't be used with sampling\n");
+        goto usage;
+    }
+    if(!opt_threads) { opt_threads = online_cpus(); }
+#if defined(_POSIX_VERSION)
+    if(opt_events_fd >= 0) { signal(SIGPIPE, SIG_IGN); }
+#endif
+
+    //
+    // Initialize the ECC/EDC tables
+    //
+    eccedc_init();
+    if(kernel_select(opt_kernel)) { goto error; }
+    if(opt_list)
+    {
+        kernel_list();
+        goto done;
+    }
+#ifdef HAVE_REPAIR
+    if(opt_undo)
+    {
+        for(f = 0; f < nfiles; f++) { returncode |= undo_run(infilenames[f]); }
+        if(returncode) { goto error; }
+        goto done;
+    }
+#endif
+    numa_init();
+    if(opt_background) { background_init(); }
+#ifdef HAVE_SERVER
+    if(opt_serve || opt_watch)
+    {
+        open_csv_file();
+        if(server_run(opt_serve)) { goto error; }
+        close_csv_file();
+        goto done;
+    }
+#endif
+    if(pool_create(&pool, opt_threads - 1))
+    {
+        printf("Out of memory\n");
+        goto error;
+    }
+
+    if(opt_dvd)
+    {
+        open_dvd_csv_file();
+        for(f = 0; f < nfiles; f++) { returncode |= dvdcheck(infilenames[f], &pool); }
+        if(returncode) { goto error; }
+    }
+    else if(opt_compare)
+    {
+        if(compare_run(nfiles, infilenames, &pool)) { goto error; }
+    }
+    else if(nfiles > 1)
+    {
+        open_csv_file();
+        if(batch_run(nfiles, infilenames, &pool)) { goto error; }
+    }
+    else
+    {
+        open_csv_file();
+        if(ecmify(infilenames[0])) { goto error; }
     }
-	
-	close_csv_file();
+
+    close_csv_file();
+    pool_destroy(&pool);
 
     //
     // Success
@@ -782,14 +7316,59 @@ int main(int argc, char **argv)
 usage:
     printf("Usage:\n"
            "\n"
-           "    edccchk cdimagefile\n");
+           "    edccchk [options] cdimagefile...\n"
+           "    ripper | edccchk [options] -\n"
+           "    edccchk merge partialfile...\n"
+           "    edccchk --serve socket [options]\n"
+           "    edccchk --watch directory [options]\n"
+           "    edccchk --undo cdimagefile...\n"
+           "\n"
+           "Options:\n"
+           "    --dvd           Check a raw DVD recording-frame dump (PI/PO ECC blocks)\n"
+           "    --kernel=LIST   Kernels as [facility:]name[,...]; a bare name is an ECC kernel\n"
+           "    --list-kernels  Show the kernels of each facility and which are selected\n"
+           "    --level=LEVEL   edc (EDC only, ECC when EDC fails), full (default) or paranoid\n"
+           "    --sample P%%    Check a stratified random P%% of the sectors and estimate the error rate\n"
+           "    --sample-sectors N  Same, checking N sectors\n"
+           "    --seed N        Seed of the sample, for repeating a run (default: the time, printed)\n"
+           "    --start-lba N   First sector of the image to check\n"
+           "    --end-lba N     Sector of the image to stop checking at (not checked)\n"
+           "    --shard K/N     Check only the Kth of N equal parts of the sectors selected\n"
+           "    --partial FILE  Save the counters to FILE for \"edccchk merge\"\n"
+           "    --device-readers N  Images read at once from a rotational disk (default: 1)\n"
+           "    --threads N     Number of worker threads (default: one per CPU)\n"
+           "    --no-numa       Don't bind worker threads to NUMA nodes\n"
+           "    --max-read-rate MB  Read at most MB megabytes per second\n"
+           "    --background    Run at idle I/O and lowest CPU priority\n"
+           "    --cache DIR     Keep the results of full checks in DIR and reuse them for unchanged images\n"
+           "    --revalidate-older-than AGE  Check cached images again after AGE (days, or N[smhd])\n"
+           "    --index         Keep chunk hashes in image.edccidx and only check changed chunks\n"
+           "    --dedupe        Check identical images given together only once\n"
+           "    --readahead MB  Page cache readahead window (default: 8, 0 for no hints)\n"
+           "    --events-fd N   Write a line to descriptor N for every sector event as it is found\n"
+           "    --ddrescue-map FILE  Write the sectors that failed as bad regions of a ddrescue mapfile\n"
+           "    --skip-map FILE Skip the sectors ddrescue didn't finish reading according to its mapfile\n"
+           "    --compare       Compare dumps of the same disc sector by sector instead of checking each\n"
+           "    --merge-out FILE  Compare, and write the best copy of every sector to FILE\n"
+           "    --ecm-out FILE  Also write the image as an ECM file\n"
+           "    --repair        Correct the failing sectors ECC can in place, keeping an undo journal\n"
+           "    --undo          Roll the images back to before their last --repair\n"
+           "    --extract-iso FILE  Also write the 2048-byte user data of every sector to FILE\n"
+           "    --extract-2336 FILE  Also write every sector without sync and header to FILE\n"
+           "    --bad-marker TEXT  Fill the extracted data of sectors failing EDC with TEXT\n"
+           "    --serve SOCKET  Check images sent as JSON lines over a Unix socket\n"
+           "    --max-queue N   Requests the server keeps waiting for a thread (default: 1024)\n"
+           "    --watch DIR     Check the files written to or moved into DIR as they arrive\n"
+           "    --json FILE     Append the result of every server or watch request to FILE\n");
 
 error:
     returncode = 1;
-	close_csv_file();
+    close_csv_file();
+    pool_destroy(&pool);
     goto done;
 
 done:
+    free(infilenames);
     return returncode;
 }
 